@@ -1,48 +1,78 @@
 #include "Barrier.h"
 #include <cstdlib>
 #include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-Barrier::Barrier(int numThreads)
-		: mutex(PTHREAD_MUTEX_INITIALIZER)
-		, cv(PTHREAD_COND_INITIALIZER)
-		, count(0)
-		, numThreads(numThreads)
-{ }
+#define BARRIER_SPIN_LIMIT 4096
 
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
 
-Barrier::~Barrier()
+static long futex(std::atomic<int> *address, int op, int value)
 {
-	if (pthread_mutex_destroy(&mutex) != 0) {
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_destroy");
-		exit(1);
-	}
-	if (pthread_cond_destroy(&cv) != 0){
-		fprintf(stderr, "[[Barrier]] error on pthread_cond_destroy");
-		exit(1);
+	return syscall(SYS_futex, reinterpret_cast<int *>(address),
+	               op | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+}
+
+Barrier::Barrier(int numThreads)
+		: count(0)
+		, phase(0)
+		, sleepers(0)
+		, numThreads(numThreads)
+		, spinLimit(0)
+{
+	long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numCpus > 1 && numThreads <= numCpus) {
+		spinLimit = BARRIER_SPIN_LIMIT;
 	}
 }
 
 
+Barrier::~Barrier()
+{ }
+
+
 void Barrier::barrier()
 {
-	if (pthread_mutex_lock(&mutex) != 0){
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_lock");
-		exit(1);
-	}
-	if (++count < numThreads) {
-		if (pthread_cond_wait(&cv, &mutex) != 0){
-			fprintf(stderr, "[[Barrier]] error on pthread_cond_wait");
+	// the phase can't change before this thread arrives, so reading it
+	// first tells which phase to wait out
+	int curPhase = phase.load(std::memory_order_acquire);
+	if (count.fetch_add(1, std::memory_order_acq_rel) + 1 == numThreads) {
+		count.store(0, std::memory_order_relaxed);
+		phase.store(curPhase + 1);
+		if (sleepers.load() > 0 && futex(&phase, FUTEX_WAKE, INT_MAX) < 0) {
+			fprintf(stderr, "[[Barrier]] error on futex wake");
 			exit(1);
 		}
-	} else {
-		count = 0;
-		if (pthread_cond_broadcast(&cv) != 0) {
-			fprintf(stderr, "[[Barrier]] error on pthread_cond_broadcast");
-			exit(1);
+		return;
+	}
+
+	for (int i = 0; i < spinLimit; ++i) {
+		if (phase.load(std::memory_order_acquire) != curPhase) {
+			return;
 		}
+		cpu_relax();
 	}
-	if (pthread_mutex_unlock(&mutex) != 0) {
-		fprintf(stderr, "[[Barrier]] error on pthread_mutex_unlock");
-		exit(1);
+
+	// the kernel checks the phase again before sleeping, so a flip between
+	// the sleepers increment and the wait can't be missed
+	sleepers.fetch_add(1);
+	while (phase.load() == curPhase) {
+		if (futex(&phase, FUTEX_WAIT, curPhase) < 0
+		    && errno != EAGAIN && errno != EINTR) {
+			fprintf(stderr, "[[Barrier]] error on futex wait");
+			exit(1);
+		}
 	}
+	sleepers.fetch_sub(1);
 }
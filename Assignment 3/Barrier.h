@@ -1,8 +1,15 @@
 #ifndef BARRIER_H
 #define BARRIER_H
-#include <pthread.h>
+#include <atomic>
 
-// a multiple use barrier
+// a multiple use, sense reversing barrier. Waiting threads spin on the
+// phase for a short while and only then sleep on it with futex, the last
+// thread to arrive flips the phase and wakes the sleepers with one futex
+// wake, and only if there are any. When there are more threads than
+// online CPUs spinning would only delay the threads still to arrive, so
+// waiting threads go to sleep right away.
+
+#define BARRIER_CACHE_LINE 64
 
 class Barrier {
 public:
@@ -11,10 +18,16 @@ public:
 	void barrier();
 
 private:
-	pthread_mutex_t mutex;
-	pthread_cond_t cv;
-	int count;
+	// arrivals, the phase and the sleepers count sit on separate cache
+	// lines, so arriving threads don't slow down the spinning ones
+	std::atomic<int> count;
+	char countPadding[BARRIER_CACHE_LINE - sizeof(std::atomic<int>)];
+	std::atomic<int> phase;
+	char phasePadding[BARRIER_CACHE_LINE - sizeof(std::atomic<int>)];
+	std::atomic<int> sleepers;
+	char sleepersPadding[BARRIER_CACHE_LINE - sizeof(std::atomic<int>)];
 	int numThreads;
+	int spinLimit;
 };
 
 #endif //BARRIER_H
@@ -0,0 +1,101 @@
+#include "InputSource.h"
+#include "SystemError.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFileSource::MappedFileSource (const char *path, char delimiter,
+                                    uint64_t split_bytes)
+    : data (nullptr), file_size (0), delimiter (delimiter),
+      split_bytes (split_bytes > 0 ? split_bytes : 1), next_offset (0)
+{
+  int fd = open (path, O_RDONLY);
+  check_system_error (fd < 0);
+  struct stat file_stat;
+  check_system_error (fstat (fd, &file_stat));
+  file_size = (uint64_t) file_stat.st_size;
+  // an empty file can't be mapped, and has no records anyway
+  if (file_size > 0)
+  {
+    void *mapping = mmap (NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    check_system_error (mapping == MAP_FAILED);
+    madvise (mapping, file_size, MADV_SEQUENTIAL);
+    data = (const char *) mapping;
+  }
+  check_system_error (close (fd));
+  check_system_error (pthread_mutex_init (&mutex, NULL));
+}
+
+MappedFileSource::~MappedFileSource ()
+{
+  if (data != nullptr)
+  {
+    munmap ((void *) data, file_size);
+  }
+  pthread_mutex_destroy (&mutex);
+}
+
+void MappedFileSource::start (int num_workers)
+{
+  offsets.resize (num_workers);
+  records.resize (num_workers);
+}
+
+bool MappedFileSource::next_split (int worker_id, InputVec &split,
+                                   uint64_t &units)
+{
+  split.clear ();
+  // only the split's bounds are claimed under the lock, looking for the
+  // delimiter that ends it takes a single memchr
+  check_system_error (pthread_mutex_lock (&mutex));
+  uint64_t begin = next_offset;
+  uint64_t end = begin;
+  if (begin < file_size)
+  {
+    end = begin + split_bytes < file_size ? begin + split_bytes : file_size;
+    const void *found = memchr (data + end - 1, delimiter, file_size - end + 1);
+    end = found == nullptr ? file_size
+                           : (uint64_t) ((const char *) found - data) + 1;
+    next_offset = end;
+  }
+  check_system_error (pthread_mutex_unlock (&mutex));
+  units = end - begin;
+  if (begin == end)
+  {
+    return false;
+  }
+
+  std::vector<FileOffset> &split_offsets = offsets[worker_id];
+  std::vector<FileRecord> &split_records = records[worker_id];
+  split_offsets.clear ();
+  split_records.clear ();
+  uint64_t record_begin = begin;
+  while (record_begin < end)
+  {
+    const void *found = memchr (data + record_begin, delimiter,
+                                end - record_begin);
+    uint64_t record_end = found == nullptr
+                          ? end : (uint64_t) ((const char *) found - data);
+    FileOffset offset;
+    offset.offset = record_begin;
+    FileRecord record;
+    record.data = data + record_begin;
+    record.size = record_end - record_begin;
+    split_offsets.push_back (offset);
+    split_records.push_back (record);
+    record_begin = record_end + 1;
+  }
+  // the vectors are filled, so pointers into them stay valid
+  for (std::size_t i = 0; i < split_records.size (); ++i)
+  {
+    split.emplace_back (&split_offsets[i], &split_records[i]);
+  }
+  return true;
+}
+
+uint64_t MappedFileSource::size () const
+{
+  return file_size;
+}
@@ -0,0 +1,159 @@
+#ifndef INPUTSOURCE_H
+#define INPUTSOURCE_H
+
+#include "MapReduceClient.h"
+#include "SystemError.h"
+#include <pthread.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define MAPPED_SPLIT_BYTES (1 << 20)
+#define ITERATOR_SPLIT_ITEMS 256
+
+/**
+ * produces the input pairs of a job split by split, so the map threads
+ * start on the first split while the rest of the input isn't read yet.
+ * next_split is called by all the map threads concurrently, every thread
+ * asking for its next split once it mapped the previous one.
+ * Progress of the map stage is counted in units, whatever a source chooses
+ * as long as size returns the total units of the whole input, or 0 when it
+ * isn't known.
+ */
+class InputSource
+{
+ public:
+  virtual ~InputSource () {}
+
+  /**
+   * called once before the map threads start.
+   * @param num_workers - number of threads calling next_split
+   */
+  virtual void start (int num_workers)
+  {
+    (void) num_workers;
+  }
+
+  /**
+   * replaces split with the pairs of the next split of the input. The pairs
+   * may point into storage of the source, valid until the same worker asks
+   * for its next split.
+   * @param worker_id - index of the calling thread in [0, num_workers)
+   * @param split - vector the split's pairs are written to
+   * @param units - set to the units of input the split covers
+   * @return false once the input is done
+   */
+  virtual bool next_split (int worker_id, InputVec &split,
+                           uint64_t &units) = 0;
+
+  virtual uint64_t size () const
+  {
+    return 0;
+  }
+};
+
+/**
+ * key 1 of a record of a mapped file, the offset of its first byte
+ */
+class FileOffset : public K1
+{
+ public:
+  uint64_t offset;
+  bool operator< (const K1 &other) const override
+  {
+    return offset < static_cast<const FileOffset &> (other).offset;
+  }
+};
+
+/**
+ * value 1 of a record of a mapped file, a view of its bytes inside the
+ * mapping without the delimiter that ends it
+ */
+class FileRecord : public V1
+{
+ public:
+  const char *data;
+  std::size_t size;
+};
+
+/**
+ * input source reading a file through mmap. The file is cut into splits of
+ * about split_bytes bytes, each extended to end right after a delimiter, so
+ * no record crosses splits and the threads cut their splits into records in
+ * parallel. Map gets a FileOffset and a FileRecord viewing the mapped bytes,
+ * nothing is copied. Progress units are bytes.
+ */
+class MappedFileSource : public InputSource
+{
+ public:
+  MappedFileSource (const char *path, char delimiter = '\n',
+                    uint64_t split_bytes = MAPPED_SPLIT_BYTES);
+  ~MappedFileSource () override;
+  void start (int num_workers) override;
+  bool next_split (int worker_id, InputVec &split, uint64_t &units) override;
+  uint64_t size () const override;
+
+ private:
+  const char *data;
+  uint64_t file_size;
+  char delimiter;
+  uint64_t split_bytes;
+  uint64_t next_offset;
+  pthread_mutex_t mutex;
+  // keys and views of the split every worker maps, reused between splits
+  std::vector<std::vector<FileOffset> > offsets;
+  std::vector<std::vector<FileRecord> > records;
+};
+
+/**
+ * input source pulling input pairs from an iterator range, a batch of
+ * batch_items pairs per split. The iterator is only advanced under a lock,
+ * so single pass iterators such as generators or stream readers work.
+ * Progress units are pairs, num_items may give their total when known.
+ */
+template <typename Iterator>
+class IteratorInputSource : public InputSource
+{
+ public:
+  IteratorInputSource (Iterator first, Iterator last, uint64_t num_items = 0,
+                       uint64_t batch_items = ITERATOR_SPLIT_ITEMS)
+      : first (first), last (last), num_items (num_items),
+        batch_items (batch_items > 0 ? batch_items : 1)
+  {
+    check_system_error (pthread_mutex_init (&mutex, NULL));
+  }
+
+  ~IteratorInputSource () override
+  {
+    pthread_mutex_destroy (&mutex);
+  }
+
+  bool next_split (int worker_id, InputVec &split, uint64_t &units) override
+  {
+    (void) worker_id;
+    split.clear ();
+    check_system_error (pthread_mutex_lock (&mutex));
+    while (first != last && split.size () < batch_items)
+    {
+      split.push_back (*first);
+      ++first;
+    }
+    check_system_error (pthread_mutex_unlock (&mutex));
+    units = split.size ();
+    return !split.empty ();
+  }
+
+  uint64_t size () const override
+  {
+    return num_items;
+  }
+
+ private:
+  Iterator first;
+  Iterator last;
+  uint64_t num_items;
+  uint64_t batch_items;
+  pthread_mutex_t mutex;
+};
+
+#endif //INPUTSOURCE_H
@@ -0,0 +1,183 @@
+#ifndef JOBCONTEXT_H
+#define JOBCONTEXT_H
+
+#include "MapReduceFrameworkExt.h"
+#include "Barrier.h"
+#include "ThreadPool.h"
+#include <pthread.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the state of a job and of its threads, shared by the framework and the
+// worker processes of ProcessJob
+#define NUM_STAGES 4
+#define COMBINE_BUFFER_PAIRS 4096
+
+/////////// typedefs ///////////
+
+typedef struct Job Job;
+typedef struct ThreadContext ThreadContext;
+typedef std::atomic<int> atomic_int;
+typedef std::atomic<bool> atomic_bool;
+typedef std::atomic<uint64_t> atomic_uint_64;
+typedef std::vector<uint64_t> offsets_vec;
+typedef std::vector<K2 *> keys_vec;
+// the work ranges are only pointed to outside the framework
+struct WorkRange;
+
+/////////// structs ///////////
+
+/**
+ * a sorted run of pairs spilled to an unlinked file. Segment i holds the
+ * pairs of thread i's key range at bytes [segment_offsets[i],
+ * segment_offsets[i + 1]), every pair written as its size and its bytes.
+ */
+struct SpillRun
+{
+    int fd;
+    // number of times the run's pairs were merged from smaller runs
+    int level = 0;
+    std::vector<uint64_t> segment_offsets;
+};
+
+struct ThreadContext
+{
+    Job *job;
+    IntermediateVec thread_vec = {};
+    std::vector<IntermediateVec> partitions;
+    IntermediateVec combine_run;
+    uint64_t buffered_pairs = 0;
+    uint64_t combine_threshold = COMBINE_BUFFER_PAIRS;
+    std::vector<SpillRun> spill_runs;
+    uint64_t shuffle_begin = 0;
+    IntermediateVec reduce_scratch;
+    OutputVec output_buffer;
+    uint64_t output_offset;
+    uint64_t pending_progress = 0;
+    unsigned int thread_id;
+
+    // profile of the thread, times are seconds since the job started
+    ThreadStats stats = {};
+    int cur_phase = NUM_JOB_PHASES;
+    double phase_begin = 0;
+    double first_begin[NUM_JOB_PHASES];
+    double last_end[NUM_JOB_PHASES];
+    double thread_begin = 0;
+    double thread_end = 0;
+    uint64_t largest_group = 0;
+    uint64_t peak_buffer_bytes = 0;
+
+    // the partitions of a worker process's map task, and the output of its
+    // reduce task
+    std::vector<std::string> process_partitions;
+    std::vector<uint64_t> process_pairs;
+    std::string process_key;
+    std::string process_output;
+    uint64_t process_output_pairs = 0;
+};
+
+struct Job
+{
+    /////////// VARIABLES ///////////
+    const MapReduceClient *client;
+    const CombinerClient *combiner;
+    const ViewReduceClient *view_reducer;
+    JobOptions options;
+    const InputVec *inputVec;
+    InputSource *input_source;
+    // input items, or input units of a source, UINT64_MAX when unknown
+    uint64_t input_vec_size;
+    OutputVec *outputVec;
+    // the shuffled pairs of all the threads, part i holds the groups of
+    // thread i, group j being [shuffle_groups[i][j],
+    // shuffle_groups[i][j + 1]) in the arena
+    IntermediatePair *shuffle_arena = nullptr;
+    std::vector<offsets_vec> shuffle_groups;
+    int multiThreadLevel;
+    int num_partitions;
+    uint64_t progress_batch = 1;
+    // the job's threads run as one gang of the shared thread pool
+    Gang *gang;
+    ThreadContext *thread_contexts;
+    WorkRange *map_ranges;
+    WorkRange *reduce_ranges;
+    Barrier *barrier;
+    keys_vec splitters;
+    bool spill_enabled;
+    bool splitters_chosen = false;
+    bool called_wait = false;
+    // monotonic time the job started at, and bytes of its shuffle arena
+    double start_time;
+    uint64_t arena_bytes = 0;
+    // set when map and reduce run in worker processes, see run_process_job
+    bool process_execution;
+    std::string error;
+
+    /////////// ATOMIC ///////////
+    atomic_uint_64 *ac_num_inter_pairs;
+    atomic_int *atomic_stage;
+    // processed items and total items of every stage, indexed by stage_t
+    atomic_uint_64 *stage_counters;
+    uint64_t stage_totals[NUM_STAGES];
+    atomic_bool *spilled;
+    // set once error describes why the job failed
+    atomic_bool *failed;
+
+    /////////// MUTEXES ///////////
+    pthread_mutex_t spill_mutex;
+};
+
+/////////// FUNCTIONS ///////////
+
+/**
+ * The pair_sort_inter function is a comparison function that sorts
+ * intermediate pairs based on the values of their first elements.
+ * @param pair1 - pair of key 2 and value 2
+ * @param pair2 - pair of key 2 and value 2
+ * @return true if *pair1 < *pair2
+ */
+bool
+pair_sort_inter (const IntermediatePair &pair1, const IntermediatePair &pair2);
+
+/**
+ * passes one group of pairs of the shuffle arena to the client, as a view
+ * when the client is a ViewReduceClient and otherwise copied into the
+ * thread's reusable reduce vector.
+ * @param context - threads context
+ * @param pairs - the group's first pair
+ * @param num_pairs - number of pairs in the group
+ */
+void reduce_pairs (void *context, const IntermediatePair *pairs,
+                   uint64_t num_pairs);
+
+/**
+ * updates the atomic counters associated with a specific job and stage.
+ * It calculates the total count based on the stage and adjusts the counter
+ * value if it exceeds the total, stores both and only then publishes the
+ * stage, so a reader that sees the stage also sees its total.
+ * It is called by a single thread when a stage starts, while the others
+ * don't report progress, and sets the batch size of the stage's reports.
+ * @param job - struct pointer to the program data
+ * @param stage - current stage the program is in
+ * @param counter - number of processed items in the current stage
+ */
+void update_atomic_counter (JobHandle job, stage_t stage, uint64_t counter);
+
+/**
+ * reads the monotonic clock.
+ * @return seconds since an arbitrary fixed point
+ */
+double now_seconds ();
+
+/**
+ * ends the thread's current phase, adding the time since it was entered to
+ * the thread's profile, and enters the given one.
+ * @param context - threads context
+ * @param phase - the phase entered, or NUM_JOB_PHASES when the thread is
+ * done
+ */
+void enter_phase (void *context, int phase);
+
+#endif //JOBCONTEXT_H
@@ -1,45 +1,155 @@
 #include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
 #include "Barrier.h"
+#include "ThreadPool.h"
+#include "SystemError.h"
+#include "JobContext.h"
+#include "ProcessJob.h"
 #include <pthread.h>
 #include <cstdio>
 #include <iostream>
 #include <atomic>
 #include <vector>
-#include <set>
+#include <unordered_map>
 #include <algorithm>
+#include <queue>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
 #define SYSTEM_ERROR "system error: system call or standard library \
 function failed"
+#define PARTITIONS_PER_THREAD 4
+#define PROGRESS_BATCHES_PER_THREAD 100
+#define CHUNK_DIVISOR 8
+#define CACHE_LINE_SIZE 64
+#define SPILL_IO_BUFFER (1 << 16)
+#define SPILL_FILE_NAME "/mapreduce_spill_XXXXXX"
+#define SPILL_MERGE_FAN_IN 16
+
+// internal structs defined below, used by the prototypes
+typedef struct WorkRange WorkRange;
+typedef struct SpillCursor SpillCursor;
+typedef struct LoserTree LoserTree;
+struct cursor_greater;
+typedef std::priority_queue<SpillCursor *, std::vector<SpillCursor *>,
+                            cursor_greater> cursor_heap;
 
 /**
- * The pair_sort_inter function is a comparison function that sorts
- * intermediate pairs based on the values of their first elements.
- * @param pair1 - pair of key 2 and value 2
- * @param pair2 - pair of key 2 and value 2
- * @return true if *pair1 < *pair2
+ * comparison function used to binary search a sorted intermediate vector
+ * for the first pair whose key is not smaller than a given key.
+ * @param pair - pair of key 2 and value 2
+ * @param key - key 2 searched for
+ * @return true if *pair.first < *key
  */
-bool
-pair_sort_inter (const IntermediatePair &pair1, const IntermediatePair &pair2);
+bool pair_key_less (const IntermediatePair &pair, const K2 *key);
 
-/** reduces intermediate vectors in parallel using multiple threads.
- * It iterates over a queue of intermediate vectors,
+/** reduces the shuffled groups in parallel using multiple threads.
+ * It claims chunks of groups, starting with its own part of the shuffle
+ * arena and stealing from the other threads' parts once it is done,
  * performs reduction operations, and updates the count of reduced pairs.
  * @param context - threads context
  */
 void threads_reduce_phase (void *context);
 
 /**
- * updates an atomic counter value associated with a specific job and stage.
- * It calculates the total count based on the stage and adjusts the counter
- * value if it exceeds certain limits before updating the atomic state.
- * @param job - struct pointer to the program data
- * @param stage - current stage the program is in
- * @param counter - number of processed items in the current stage
+ * sets the work range of every thread to an even share of the items
+ * [0, num_items) of part 0.
+ * @param context - threads context of the first thread
+ * @param ranges - work ranges of all the threads
+ * @param num_items - number of items to share
+ */
+void init_work_ranges (void *context, WorkRange *ranges, uint64_t num_items);
+
+/**
+ * claims the next chunk of work for the calling thread. Chunks are taken
+ * from the front of the thread's own range and hold a fixed fraction of
+ * what is left in it, so they start big and get small towards the tail.
+ * Once its own range is empty the thread steals the back half of another
+ * thread's remaining range, which becomes its own range.
+ * @param context - threads context
+ * @param ranges - work ranges of all the threads
+ * @param part - set to the part the chunk's items belong to
+ * @param first - set to the chunk's first item
+ * @param last - set to one past the chunk's last item
+ * @return false when no work is left in any of the ranges
+ */
+bool claim_chunk (void *context, WorkRange *ranges, int &part,
+                  uint64_t &first, uint64_t &last);
+
+/**
+ * closes the group of pairs the thread just wrote to its slice of the
+ * shuffle arena, which runs from the end of its previous group to
+ * group_end. When the job splits big keys, a group bigger than the
+ * threshold is cut into groups of at most threshold pairs that are reduced
+ * separately.
+ * @param context - threads context
+ * @param group_end - arena index one past the group's last pair
+ */
+void push_key_group (void *context, uint64_t group_end);
+
+/**
+ * finds the pairs of one thread's key range inside one sorted thread
+ * vector.
+ * @param context - threads context
+ * @param range_id - index of the key range
+ * @param vec_id - index of the thread whose vector is searched
+ * @param begin - set to the index of the range's first pair
+ * @param end - set to one past the index of the range's last pair
+ */
+void range_bounds (void *context, unsigned int range_id, int vec_id,
+                   uint64_t &begin, uint64_t &end);
+
+/**
+ * allocates the shuffle arena, so all the shuffled pairs of the job end up
+ * in one contiguous array. In a HASH_GROUPING job it also counts the pairs
+ * every thread is going to shuffle and gives every thread its slice.
+ * @param context - threads context
+ */
+void size_shuffle_arena (void *context);
+
+/**
+ * adds processed items of the current stage to the thread's pending count,
+ * and flushes them into the atomic state once a whole batch is pending.
+ * No lock is taken, so progress tracking costs one fetch_add per batch.
+ * @param context - threads context
+ * @param processed - number of items the thread just processed
+ */
+void report_progress (void *context, uint64_t processed);
+
+/**
+ * adds the thread's pending processed items to the current stage's atomic
+ * counter with a single fetch_add.
+ * @param context - threads context
+ */
+void flush_progress (void *context);
+
+/**
+ * maps the pairs of a job whose input comes from an input source, split by
+ * split, until the source is done.
+ * @param context - threads context
  */
-void update_atomic_counter (JobHandle job, stage_t stage, int counter);
+void threads_map_source (void *context);
+
+/**
+ * sets up a job and starts its threads, reading the input from the input
+ * vector or, when it is null, from the input source.
+ * @param client - the map and reduce functions of the job
+ * @param inputVec - input elements, or null
+ * @param source - source of the input pairs when inputVec is null
+ * @param outputVec - vector the output elements are added to
+ * @param multiThreadLevel - number of worker threads
+ * @param options - job settings
+ * @return handle of the started job
+ */
+JobHandle start_job (const MapReduceClient &client, const InputVec *inputVec,
+                     InputSource *source, OutputVec &outputVec,
+                     int multiThreadLevel, const JobOptions &options);
 
 /**
  * processing input pairs in parallel using multiple threads.
- * It iterates over the input vector, updates an atomic counter,
+ * It claims chunks of the input vector, updates an atomic counter,
  * and performs mapping operations on each input pair.
  * The goal is to process all the input pairs until the
  * end of the vector is reached.
@@ -48,14 +158,239 @@ void update_atomic_counter (JobHandle job, stage_t stage, int counter);
 void threads_map_phase (void *context);
 
 /**
- * performs the shuffling phase by iterating over ordered keys and populating
- * a shuffle vector with intermediate pairs from multiple thread vectors.
+ * counts the pairs of all the sorted thread vectors whose key is smaller
+ * than the given key.
+ * @param context - threads context
+ * @param key - key 2 to rank
+ * @return number of pairs below the key
+ */
+uint64_t key_rank (void *context, const K2 *key);
+
+/**
+ * finds the key of the pair at the given rank of the merged sorted thread
+ * vectors, without merging them. In every vector it binary searches for the
+ * last pair whose key ranks at most rank; the biggest of these keys is the
+ * one at the rank.
+ * @param context - threads context
+ * @param rank - index in the merged order, smaller than the number of pairs
+ * @return key 2 at the rank
+ */
+K2 *key_at_rank (void *context, uint64_t rank);
+
+/**
+ * picks the lower splitter of the calling thread's key range, the key at
+ * rank id * pairs / multiThreadLevel of the merged thread vectors, so every
+ * thread merges an equal share of the pairs give or take the key the cut
+ * falls on, whose pairs all go to the upper range. Range i holds the keys in
+ * [splitters[i - 1], splitters[i]), the first and last ranges are open
+ * ended. The rank of the splitter is also where the thread's slice of the
+ * shuffle arena begins. All the threads pick their splitters in parallel.
+ * @param context - threads context
+ */
+void choose_splitter (void *context);
+
+/**
+ * performs the shuffling phase of the calling thread's key range by merging
+ * the range's pairs from all the sorted thread vectors with a loser tree,
+ * and populating the thread's slice of the shuffle arena with the merged
+ * pairs. Every key change in the merged order closes a group, so keys are
+ * never looked up. All the threads shuffle their own ranges in parallel.
  * It updates an atomic counter to track the number of processed pairs
  * during the shuffling stage.
  * @param context - threads context
  */
 void shuffle (void *context);
 
+/**
+ * tells whether the next pair of one merged range is smaller than the next
+ * pair of another. Ranges that are done are bigger than all the others.
+ * @param tree - loser tree of the ranges
+ * @param source1 - index of the first range
+ * @param source2 - index of the second range
+ * @return true if source1's next pair is smaller
+ */
+bool source_less (LoserTree &tree, int source1, int source2);
+
+/**
+ * plays all the matches of a loser tree from its leaves up.
+ * @param tree - loser tree whose ranges are set
+ */
+void build_loser_tree (LoserTree &tree);
+
+/**
+ * replays the matches on the path from the winner's leaf to the root, after
+ * the winner's range moved on to its next pair.
+ * @param tree - loser tree
+ */
+void replay_loser_tree (LoserTree &tree);
+
+/**
+ * performs the shuffling phase of a HASH_GROUPING job. Every thread owns
+ * the hash partitions whose index equals its id modulo multiThreadLevel,
+ * gathers the pairs of its partitions from all the threads by key 2 equality
+ * and populates its part of the shuffle vector with the groups.
+ * @param context - threads context
+ */
+void hash_shuffle (void *context);
+
+/**
+ * moves the output pairs collected by every thread into the output vector.
+ * Thread 0 grows the output vector once, then every thread copies its own
+ * buffer into its slice in parallel.
+ * @param context - threads context
+ */
+void splice_output (void *context);
+
+/**
+ * folds every run of pairs sharing a key in the given pairs into a single
+ * pair with the client's combine function. In a SORTED_GROUPING job the
+ * pairs are sorted first and runs are found by order, in a HASH_GROUPING
+ * job the runs are gathered by hash without sorting.
+ * @param context - threads context
+ * @param pairs - pairs to combine, replaced by the combined pairs
+ */
+void combine_pairs (void *context, IntermediateVec &pairs);
+
+/**
+ * moves a run of pairs sharing a key to the combined pairs, folded into a
+ * single pair by the client's combine function unless it holds one pair.
+ * @param context - threads context
+ * @param run - pairs sharing a key, left empty
+ * @param combined - vector the folded pair is added to
+ */
+void combine_run (void *context, IntermediateVec &run,
+                  IntermediateVec &combined);
+
+/**
+ * combines all the pairs the thread buffered so far. When combining doesn't
+ * at least halve the buffer, the buffer size that triggers the next combine
+ * is doubled, so mostly distinct keys aren't combined over and over.
+ * @param context - threads context
+ */
+void combine_buffer (void *context);
+
+/**
+ * sorts the thread's buffered pairs, combining them first when the job has a
+ * combiner, and writes them to a new run file cut into one segment per
+ * thread's key range. The first thread to spill picks the splitters of the
+ * key ranges. The written pairs are deleted and the buffer is emptied.
+ * @param context - threads context
+ */
+void spill_buffer (void *context);
+
+/**
+ * picks multiThreadLevel - 1 evenly spaced keys of the thread's sorted
+ * buffer as the splitters of a spilled job. The splitters are copies made
+ * through the serializer, since the buffer's keys are deleted once spilled.
+ * @param context - threads context
+ */
+void choose_spill_splitters (void *context);
+
+/**
+ * creates a new empty run file in the job's spill directory and unlinks it
+ * right away, so it is gone once closed.
+ * @param context - threads context
+ * @param run - set to the new run, holding the offset of its first segment
+ */
+void open_run (void *context, SpillRun *run);
+
+/**
+ * writes the whole buffer to the end of a file, retrying partial writes.
+ * @param fd - file descriptor of the file
+ * @param buffer - bytes to write
+ */
+void write_all (int fd, const std::string &buffer);
+
+/**
+ * appends bytes of pairs to a run's write buffer, writing the buffer to the
+ * run's file once it is big enough.
+ * @param run - run the bytes belong to
+ * @param buffer - write buffer of the run
+ * @param bytes - start of the bytes to add
+ * @param size - number of bytes to add
+ * @param offset - offset in the run after the buffered bytes, advanced
+ */
+void append_run_bytes (SpillRun *run, std::string &buffer,
+                       const char *bytes, uint64_t size, uint64_t &offset);
+
+/**
+ * opens a cursor on one segment of every given run where that segment isn't
+ * empty and pushes the cursors with their first pairs to a heap.
+ * @param context - threads context
+ * @param runs - vector of the runs to read
+ * @param segment - index of the segment read in every run
+ * @param cursors - vector the cursors are kept in, the heap points into it
+ * @param heap - heap the cursors are pushed to
+ */
+void open_cursors (void *context, std::vector<SpillRun> &runs,
+                   unsigned int segment, std::vector<SpillCursor> &cursors,
+                   cursor_heap &heap);
+
+/**
+ * merges the thread's last SPILL_MERGE_FAN_IN runs into a single run of the
+ * next level, segment by segment, once they all share a level. Every pair
+ * is merged again only once per level, and the number of open run files
+ * and of cursors a reducing thread merges grows only with the logarithm of
+ * the number of spills.
+ * @param context - threads context
+ */
+void compact_spill_runs (void *context);
+
+/**
+ * merges runs into a new run one level above them and closes them.
+ * @param context - threads context
+ * @param runs - vector of the runs to merge, all of the same level
+ * @param merged - set to the merged run
+ */
+void merge_runs (void *context, std::vector<SpillRun> &runs,
+                 SpillRun *merged);
+
+/**
+ * makes sure the next needed bytes of a cursor's segment are in its buffer,
+ * moving leftover bytes to the front and reading more of the file.
+ * @param cursor - cursor of a run segment
+ * @param needed - number of bytes needed from the current position
+ * @return false when the segment has less than needed bytes left
+ */
+bool fill_cursor (SpillCursor *cursor, uint64_t needed);
+
+/**
+ * reads the next pair of a run segment into the cursor.
+ * @param context - threads context
+ * @param cursor - cursor of a run segment
+ * @return false when the segment has no pairs left
+ */
+bool next_spilled_pair (void *context, SpillCursor *cursor);
+
+/**
+ * passes a complete group of pairs to reduce and empties it.
+ * @param context - threads context
+ * @param group - pairs sharing a key
+ */
+void reduce_group (void *context, IntermediateVec &group);
+
+/**
+ * streams a k-way merge of the calling thread's segments of all the run
+ * files, reducing every key as soon as its group is complete, so only one
+ * group and one read buffer per run are in memory at a time.
+ * @param context - threads context
+ */
+void merge_spill_runs (void *context);
+
+/**
+ * sorts the thread's pairs, shuffles them by key range or by hash and
+ * reduces the shuffled groups, all in memory.
+ * @param context - threads context
+ */
+void sort_shuffle_reduce (void *context);
+
+/**
+ * spills the pairs the thread still buffers and reduces a merge of the
+ * job's run files.
+ * @param context - threads context
+ */
+void spilled_shuffle_reduce (void *context);
+
 /**
  * the main entry point for each thread in the parallel execution.
  * It sequentially executes the map, sort, shuffle, and reduce phases based on
@@ -66,297 +401,1443 @@ void shuffle (void *context);
 void *thread_func (void *context);
 
 /**
- * custom comparison operator that compares two pointers to objects of type K2
+ * waits at the job's barrier, counting the wait as the thread's barrier
+ * time instead of its current phase's time.
+ * @param context - threads context
+ */
+void wait_barrier (void *context);
+
+/**
+ * locks a work range mutex, counting the time spent waiting for it when it
+ * was held by another thread.
+ * @param context - threads context
+ * @param mutex - the mutex to lock
+ */
+void lock_range (void *context, pthread_mutex_t *mutex);
+
+/**
+ * updates the thread's peak with the bytes its pair buffers hold now.
+ * @param context - threads context
+ */
+void sample_buffer_bytes (void *context);
+
+/**
+ * hash and equality of key 2 pointers, used by HASH_GROUPING jobs
  */
-struct compare
+struct key_hash
+{
+    std::size_t operator() (const K2 *key) const
+    {
+      return static_cast<const HashableK2 *> (key)->hash ();
+    }
+};
+
+struct key_equal
 {
     bool operator() (const K2 *key1, const K2 *key2) const
     {
-      return *key2 < *key1;
+      return static_cast<const HashableK2 *> (key1)->equals (*key2);
     }
 };
 
 /////////// typedefs ///////////
 
-typedef struct Job Job;
-typedef struct ThreadContext ThreadContext;
-typedef std::set<K2 *, compare> keys_set;
-typedef std::atomic<int> atomic_int;
-typedef std::atomic<int64_t> atomic_int_64;
-typedef std::vector<IntermediateVec *> vec_queue;
+typedef std::unordered_map<K2 *, uint64_t, key_hash, key_equal>
+    keys_index_map;
 
 /////////// structs ///////////
 
+/**
+ * the items [begin, end) of one part, owned by a single thread. The owner
+ * claims chunks from its front and threads without work steal from its
+ * back, both under the range's mutex.
+ */
+struct WorkRange
+{
+    pthread_mutex_t mutex;
+    int part;
+    uint64_t begin;
+    uint64_t end;
+    // keeps the ranges of different threads on different cache lines
+    char padding[CACHE_LINE_SIZE];
+};
+
+/**
+ * reading position of a thread inside one segment of a run, with the
+ * segment's next pair
+ */
+struct SpillCursor
+{
+    int fd;
+    uint64_t file_offset;
+    uint64_t file_end;
+    std::vector<char> buffer;
+    uint64_t buffer_begin = 0;
+    uint64_t buffer_end = 0;
+    // the next pair and where its record starts in the buffer
+    IntermediatePair pair;
+    uint64_t record_begin = 0;
+};
+
+/**
+ * orders cursors so the priority queue's top is the one with the smallest
+ * pair
+ */
+struct cursor_greater
+{
+    bool operator() (const SpillCursor *cursor1,
+                     const SpillCursor *cursor2) const
+    {
+      return *cursor2->pair.first < *cursor1->pair.first;
+    }
+};
+
+/**
+ * tournament tree merging the sorted ranges [heads[i], ends[i]) of all the
+ * thread vectors. nodes[0] is the range with the smallest next pair, every
+ * other node keeps the loser of the match played there, and the leaves of
+ * ranges i >= number of thread vectors are always done.
+ */
+struct LoserTree
+{
+    Job *job;
+    std::vector<uint64_t> heads;
+    std::vector<uint64_t> ends;
+    std::vector<int> nodes;
+    int num_leaves;
+};
+
+/////////// FUNCTIONS ///////////
+
+void check_system_error (int indicator)
+{
+  if (indicator)
+  {
+    std::cout << SYSTEM_ERROR << std::endl;
+    exit (1);
+  }
+}
+
+bool
+pair_sort_inter (const IntermediatePair &pair1, const IntermediatePair &pair2)
+{
+  return (*pair1.first) < (*pair2.first);
+}
+
+bool pair_key_less (const IntermediatePair &pair, const K2 *key)
+{
+  return (*pair.first) < (*key);
+}
+
+void update_atomic_counter (JobHandle job, stage_t stage, uint64_t counter)
+{
+  Job *cur_job = (Job *) job;
+  uint64_t total = 0;
+  switch (stage)
+  {
+    case UNDEFINED_STAGE:
+      break;
+    case MAP_STAGE:
+      total = cur_job->input_vec_size;
+      break;
+    default:
+      total = *cur_job->ac_num_inter_pairs;
+      break;
+  }
+  if (counter >= total)
+  {
+    counter = total;
+  }
+
+  // every thread flushes about PROGRESS_BATCHES_PER_THREAD times per stage
+  uint64_t batches = cur_job->multiThreadLevel * PROGRESS_BATCHES_PER_THREAD;
+  uint64_t batch = total / batches;
+  cur_job->progress_batch = batch > 0 ? batch : 1;
+  cur_job->stage_totals[stage] = total;
+  cur_job->stage_counters[stage] = counter;
+  *(cur_job->atomic_stage) = stage;
+}
+
+void report_progress (void *context, uint64_t processed)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  cur_context->pending_progress += processed;
+  if (cur_context->pending_progress >= cur_context->job->progress_batch)
+  {
+    flush_progress (context);
+  }
+}
+
+void flush_progress (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  if (cur_context->pending_progress > 0)
+  {
+    Job *job = cur_context->job;
+    int stage = job->atomic_stage->load (std::memory_order_relaxed);
+    job->stage_counters[stage].fetch_add (cur_context->pending_progress);
+    cur_context->pending_progress = 0;
+  }
+}
+
+void init_work_ranges (void *context, WorkRange *ranges, uint64_t num_items)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  int num_ranges = cur_context->job->multiThreadLevel;
+  for (int i = 0; i < num_ranges; ++i)
+  {
+    ranges[i].part = 0;
+    ranges[i].begin = (num_items * i) / num_ranges;
+    ranges[i].end = (num_items * (i + 1)) / num_ranges;
+  }
+}
+
+bool claim_chunk (void *context, WorkRange *ranges, int &part,
+                  uint64_t &first, uint64_t &last)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  int num_ranges = cur_context->job->multiThreadLevel;
+  WorkRange &own_range = ranges[cur_context->thread_id];
+  while (true)
+  {
+    lock_range (context, &own_range.mutex);
+    uint64_t remaining = own_range.end - own_range.begin;
+    if (remaining > 0)
+    {
+      uint64_t chunk = remaining / CHUNK_DIVISOR;
+      part = own_range.part;
+      first = own_range.begin;
+      last = first + (chunk > 0 ? chunk : 1);
+      own_range.begin = last;
+    }
+    int unlock_success = pthread_mutex_unlock (&own_range.mutex);
+    check_system_error (unlock_success);
+    if (remaining > 0)
+    {
+      return true;
+    }
+
+    // steal the back half of the first range that still has work, never
+    // holding two range locks at once
+    bool stolen = false;
+    for (int i = 1; i < num_ranges && !stolen; ++i)
+    {
+      int victim_id = (int) (cur_context->thread_id + i) % num_ranges;
+      WorkRange &victim = ranges[victim_id];
+      lock_range (context, &victim.mutex);
+      uint64_t victim_remaining = victim.end - victim.begin;
+      int stolen_part = victim.part;
+      uint64_t stolen_end = victim.end;
+      if (victim_remaining > 0)
+      {
+        victim.end -= (victim_remaining + 1) / 2;
+        stolen = true;
+      }
+      uint64_t stolen_begin = victim.end;
+      unlock_success = pthread_mutex_unlock (&victim.mutex);
+      check_system_error (unlock_success);
+
+      if (stolen)
+      {
+        lock_range (context, &own_range.mutex);
+        own_range.part = stolen_part;
+        own_range.begin = stolen_begin;
+        own_range.end = stolen_end;
+        unlock_success = pthread_mutex_unlock (&own_range.mutex);
+        check_system_error (unlock_success);
+      }
+    }
+    if (!stolen)
+    {
+      return false;
+    }
+  }
+}
+
+void threads_map_source (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  InputVec split;
+  uint64_t units = 0;
+  while (job->input_source->next_split ((int) cur_context->thread_id, split,
+                                        units))
+  {
+    for (const InputPair &cur_pair: split)
+    {
+      job->client->map (cur_pair.first, cur_pair.second, context);
+    }
+    cur_context->stats.items_mapped += split.size ();
+    report_progress (context, units);
+  }
+  flush_progress (context);
+}
+
+void threads_map_phase (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  if (job->input_source != nullptr)
+  {
+    threads_map_source (context);
+    return;
+  }
+  int part = 0;
+  uint64_t first = 0;
+  uint64_t last = 0;
+  while (claim_chunk (context, job->map_ranges, part, first, last))
+  {
+    for (uint64_t i = first; i < last; ++i)
+    {
+      const InputPair &cur_pair = (*(job->inputVec))[i];
+      job->client->map (cur_pair.first, cur_pair.second, context);
+      report_progress (context, 1);
+    }
+    cur_context->stats.items_mapped += last - first;
+  }
+  flush_progress (context);
+}
+
+uint64_t key_rank (void *context, const K2 *key)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  uint64_t rank = 0;
+  for (int i = 0; i < job->multiThreadLevel; ++i)
+  {
+    IntermediateVec &vec2 = job->thread_contexts[i].thread_vec;
+    rank += std::lower_bound (vec2.begin (), vec2.end (), key, pair_key_less)
+            - vec2.begin ();
+  }
+  return rank;
+}
+
+K2 *key_at_rank (void *context, uint64_t rank)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  K2 *key = nullptr;
+  for (int i = 0; i < job->multiThreadLevel; ++i)
+  {
+    // the ranks of a sorted vector's keys only grow, so the last pair
+    // ranked at most rank is found by binary search
+    IntermediateVec &vec2 = job->thread_contexts[i].thread_vec;
+    uint64_t low = 0;
+    uint64_t high = vec2.size ();
+    while (low < high)
+    {
+      uint64_t middle = low + (high - low) / 2;
+      if (key_rank (context, vec2[middle].first) <= rank)
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+    if (low > 0 && (key == nullptr || *key < *vec2[low - 1].first))
+    {
+      key = vec2[low - 1].first;
+    }
+  }
+  return key;
+}
+
+void choose_splitter (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  unsigned int id = cur_context->thread_id;
+  uint64_t num_pairs = *job->ac_num_inter_pairs;
+  cur_context->shuffle_begin = 0;
+  if (id == 0 || num_pairs == 0)
+  {
+    return;
+  }
+  K2 *splitter = key_at_rank (context,
+                              (id * num_pairs) / job->multiThreadLevel);
+  job->splitters[id - 1] = splitter;
+  cur_context->shuffle_begin = key_rank (context, splitter);
+}
+
+void push_key_group (void *context, uint64_t group_end)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  offsets_vec &groups = job->shuffle_groups[cur_context->thread_id];
+  uint64_t threshold = job->options.split_reduce_threshold;
+  if (threshold != 0)
+  {
+    while (group_end - groups.back () > threshold)
+    {
+      groups.push_back (groups.back () + threshold);
+    }
+  }
+  groups.push_back (group_end);
+}
+
+void range_bounds (void *context, unsigned int range_id, int vec_id,
+                   uint64_t &begin, uint64_t &end)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  K2 *lower = range_id == 0 ? nullptr : job->splitters[range_id - 1];
+  K2 *upper = range_id == job->splitters.size () ? nullptr
+                                                   : job->splitters[range_id];
+  IntermediateVec &vec2 = job->thread_contexts[vec_id].thread_vec;
+  begin = lower == nullptr ? 0 : std::lower_bound (
+      vec2.begin (), vec2.end (), lower, pair_key_less) - vec2.begin ();
+  end = upper == nullptr ? vec2.size () : std::lower_bound (
+      vec2.begin (), vec2.end (), upper, pair_key_less) - vec2.begin ();
+}
+
+void size_shuffle_arena (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  uint64_t offset = 0;
+  if (job->options.grouping == SORTED_GROUPING)
+  {
+    // every thread finds its own slice when it picks its splitter
+    offset = *job->ac_num_inter_pairs;
+  }
+  else
+  {
+    for (int t = 0; t < job->multiThreadLevel; ++t)
+    {
+      job->thread_contexts[t].shuffle_begin = offset;
+      for (int i = 0; i < job->multiThreadLevel; ++i)
+      {
+        for (int p = t; p < job->num_partitions; p += job->multiThreadLevel)
+        {
+          offset += job->thread_contexts[i].partitions[p].size ();
+        }
+      }
+    }
+  }
+  // raw storage, every pair is constructed once when it is shuffled
+  job->arena_bytes = offset * sizeof (IntermediatePair);
+  job->shuffle_arena = static_cast<IntermediatePair *> (
+      ::operator new (offset * sizeof (IntermediatePair)));
+}
+
+bool source_less (LoserTree &tree, int source1, int source2)
+{
+  int num_sources = tree.job->multiThreadLevel;
+  bool done1 = source1 >= num_sources
+               || tree.heads[source1] == tree.ends[source1];
+  bool done2 = source2 >= num_sources
+               || tree.heads[source2] == tree.ends[source2];
+  if (done1 || done2)
+  {
+    return !done1;
+  }
+  IntermediateVec &vec1 = tree.job->thread_contexts[source1].thread_vec;
+  IntermediateVec &vec2 = tree.job->thread_contexts[source2].thread_vec;
+  return *vec1[tree.heads[source1]].first < *vec2[tree.heads[source2]].first;
+}
+
+void build_loser_tree (LoserTree &tree)
+{
+  int num_leaves = 1;
+  while (num_leaves < tree.job->multiThreadLevel)
+  {
+    num_leaves *= 2;
+  }
+  tree.num_leaves = num_leaves;
+  tree.nodes.assign (num_leaves, 0);
+
+  // winners of the matches played so far, leaf i at num_leaves + i
+  std::vector<int> winners (2 * num_leaves);
+  for (int i = 0; i < num_leaves; ++i)
+  {
+    winners[num_leaves + i] = i;
+  }
+  for (int node = num_leaves - 1; node > 0; --node)
+  {
+    int left = winners[2 * node];
+    int right = winners[2 * node + 1];
+    bool right_wins = source_less (tree, right, left);
+    winners[node] = right_wins ? right : left;
+    tree.nodes[node] = right_wins ? left : right;
+  }
+  tree.nodes[0] = winners[1];
+}
+
+void replay_loser_tree (LoserTree &tree)
+{
+  int winner = tree.nodes[0];
+  for (int node = (tree.num_leaves + winner) / 2; node > 0; node /= 2)
+  {
+    if (source_less (tree, tree.nodes[node], winner))
+    {
+      std::swap (tree.nodes[node], winner);
+    }
+  }
+  tree.nodes[0] = winner;
+}
+
+void shuffle (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  unsigned int id = cur_context->thread_id;
+  uint64_t position = cur_context->shuffle_begin;
+  job->shuffle_groups[id].assign (1, position);
+  if (*job->ac_num_inter_pairs == 0)
+  {
+    return;
+  }
+
+  LoserTree tree;
+  tree.job = job;
+  tree.heads.resize (job->multiThreadLevel);
+  tree.ends.resize (job->multiThreadLevel);
+  for (int i = 0; i < job->multiThreadLevel; ++i)
+  {
+    range_bounds (context, id, i, tree.heads[i], tree.ends[i]);
+  }
+  build_loser_tree (tree);
+
+  IntermediatePair *arena = job->shuffle_arena;
+  uint64_t group_begin = position;
+  K2 *group_key = nullptr;
+  while (tree.nodes[0] < job->multiThreadLevel
+         && tree.heads[tree.nodes[0]] < tree.ends[tree.nodes[0]])
+  {
+    int source = tree.nodes[0];
+    const IntermediatePair &pair =
+        job->thread_contexts[source].thread_vec[tree.heads[source]++];
+    // pairs come in ascending order, so a bigger key starts a new group
+    if (group_key != nullptr && *group_key < *pair.first)
+    {
+      report_progress (context, position - group_begin);
+      push_key_group (context, position);
+      group_begin = position;
+      group_key = nullptr;
+    }
+    if (group_key == nullptr)
+    {
+      group_key = pair.first;
+    }
+    new (arena + position++) IntermediatePair (pair);
+    replay_loser_tree (tree);
+  }
+  if (position > group_begin)
+  {
+    report_progress (context, position - group_begin);
+    push_key_group (context, position);
+  }
+  flush_progress (context);
+}
+
+void hash_shuffle (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  IntermediatePair *arena = job->shuffle_arena;
+  uint64_t position = cur_context->shuffle_begin;
+  job->shuffle_groups[cur_context->thread_id].assign (1, position);
+  for (int p = (int) cur_context->thread_id; p < job->num_partitions;
+       p += job->multiThreadLevel)
+  {
+    // first pass numbers the groups by their first pair and counts their
+    // pairs, the second scatters every pair to its group's place
+    keys_index_map group_index;
+    offsets_vec group_next;
+    offsets_vec pair_groups;
+    for (int i = 0; i < job->multiThreadLevel; ++i)
+    {
+      for (const IntermediatePair &pair: job->thread_contexts[i].partitions[p])
+      {
+        uint64_t index = group_index.emplace (pair.first, group_next.size ())
+            .first->second;
+        if (index == group_next.size ())
+        {
+          group_next.push_back (0);
+        }
+        group_next[index]++;
+        pair_groups.push_back (index);
+      }
+    }
+    for (uint64_t &next: group_next)
+    {
+      uint64_t group_size = next;
+      next = position;
+      position += group_size;
+    }
+    uint64_t pair_index = 0;
+    for (int i = 0; i < job->multiThreadLevel; ++i)
+    {
+      for (const IntermediatePair &pair: job->thread_contexts[i].partitions[p])
+      {
+        uint64_t &next = group_next[pair_groups[pair_index++]];
+        new (arena + next++) IntermediatePair (pair);
+      }
+    }
+    // every group's next place is now the end of the group
+    for (uint64_t group_end: group_next)
+    {
+      push_key_group (context, group_end);
+    }
+    report_progress (context, pair_groups.size ());
+  }
+  flush_progress (context);
+}
+
+void combine_run (void *context, IntermediateVec &run,
+                  IntermediateVec &combined)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  if (run.size () == 1)
+  {
+    combined.push_back (run.front ());
+  }
+  else
+  {
+    // the run's first key stays, combine may delete the other keys and values
+    V2 *value = cur_context->job->combiner->combine (&run);
+    combined.emplace_back (run.front ().first, value);
+  }
+  run.clear ();
+}
+
+void combine_pairs (void *context, IntermediateVec &pairs)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  IntermediateVec &run = cur_context->combine_run;
+  IntermediateVec combined;
+  if (job->options.grouping == SORTED_GROUPING)
+  {
+    std::sort (pairs.begin (), pairs.end (), pair_sort_inter);
+    for (const IntermediatePair &pair: pairs)
+    {
+      if (!run.empty () && *run.front ().first < *pair.first)
+      {
+        combine_run (context, run, combined);
+      }
+      run.push_back (pair);
+    }
+    if (!run.empty ())
+    {
+      combine_run (context, run, combined);
+    }
+  }
+  else
+  {
+    keys_index_map group_index;
+    std::vector<IntermediateVec> groups;
+    for (const IntermediatePair &pair: pairs)
+    {
+      uint64_t index = group_index.emplace (pair.first, groups.size ())
+          .first->second;
+      if (index == groups.size ())
+      {
+        groups.emplace_back ();
+      }
+      groups[index].push_back (pair);
+    }
+    for (IntermediateVec &group: groups)
+    {
+      run.swap (group);
+      combine_run (context, run, combined);
+    }
+  }
+  *job->ac_num_inter_pairs -= pairs.size () - combined.size ();
+  pairs.swap (combined);
+}
+
+void combine_buffer (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  sample_buffer_bytes (context);
+  uint64_t buffered_pairs = 0;
+  if (cur_context->job->options.grouping == SORTED_GROUPING)
+  {
+    combine_pairs (context, cur_context->thread_vec);
+    buffered_pairs = cur_context->thread_vec.size ();
+  }
+  else
+  {
+    // equal keys always share a partition, so every partition is combined
+    // on its own
+    for (IntermediateVec &partition: cur_context->partitions)
+    {
+      combine_pairs (context, partition);
+      buffered_pairs += partition.size ();
+    }
+  }
+  cur_context->buffered_pairs = buffered_pairs;
+  if (buffered_pairs > cur_context->combine_threshold / 2)
+  {
+    cur_context->combine_threshold *= 2;
+  }
+}
+
+void splice_output (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  if (cur_context->thread_id == 0)
+  {
+    // pairs already in the output vector stay in front of the job's pairs
+    uint64_t offset = job->outputVec->size ();
+    for (int i = 0; i < job->multiThreadLevel; ++i)
+    {
+      job->thread_contexts[i].output_offset = offset;
+      offset += job->thread_contexts[i].output_buffer.size ();
+    }
+    job->outputVec->resize (offset);
+  }
+  wait_barrier (context);
+  OutputVec &buffer = cur_context->output_buffer;
+  std::copy (buffer.begin (), buffer.end (),
+             job->outputVec->begin () + cur_context->output_offset);
+  OutputVec ().swap (buffer);
+}
+
+void choose_spill_splitters (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  const PairSerializer *serializer = job->options.spill_serializer;
+  IntermediateVec &vec2 = cur_context->thread_vec;
+  uint64_t vec_size = vec2.size ();
+  std::string bytes;
+  for (int i = 1; i < job->multiThreadLevel; ++i)
+  {
+    const IntermediatePair &pair = vec2[(i * vec_size) / job->multiThreadLevel];
+    bytes.clear ();
+    serializer->serialize (pair.first, pair.second, bytes);
+    IntermediatePair copy = serializer->deserialize (bytes.data (),
+                                                     bytes.size ());
+    delete copy.second;
+    job->splitters[i - 1] = copy.first;
+  }
+}
+
+void open_run (void *context, SpillRun *run)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  std::string path = std::string (cur_context->job->options.spill_directory)
+                     + SPILL_FILE_NAME;
+  run->fd = mkstemp (&path[0]);
+  check_system_error (run->fd < 0);
+  check_system_error (unlink (path.c_str ()));
+  run->segment_offsets.assign (1, 0);
+}
+
+void write_all (int fd, const std::string &buffer)
+{
+  uint64_t written = 0;
+  while (written < buffer.size ())
+  {
+    ssize_t cur_written = write (fd, buffer.data () + written,
+                                 buffer.size () - written);
+    check_system_error (cur_written < 0);
+    written += cur_written;
+  }
+}
+
+void append_run_bytes (SpillRun *run, std::string &buffer,
+                       const char *bytes, uint64_t size, uint64_t &offset)
+{
+  buffer.append (bytes, size);
+  offset += size;
+  if (buffer.size () >= SPILL_IO_BUFFER)
+  {
+    write_all (run->fd, buffer);
+    buffer.clear ();
+  }
+}
+
+void spill_buffer (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  IntermediateVec &vec2 = cur_context->thread_vec;
+  if (job->combiner != nullptr)
+  {
+    combine_buffer (context);
+  }
+  else
+  {
+    sample_buffer_bytes (context);
+    std::sort (vec2.begin (), vec2.end (), pair_sort_inter);
+  }
+
+  // the splitters never change once chosen, so they are read without the
+  // lock after it was taken once
+  int lock_success = pthread_mutex_lock (&job->spill_mutex);
+  check_system_error (lock_success);
+  if (!job->splitters_chosen)
+  {
+    choose_spill_splitters (context);
+    job->splitters_chosen = true;
+  }
+  int unlock_success = pthread_mutex_unlock (&job->spill_mutex);
+  check_system_error (unlock_success);
+
+  const PairSerializer *serializer = job->options.spill_serializer;
+  SpillRun run;
+  open_run (context, &run);
+  std::string buffer;
+  std::string record;
+  uint64_t offset = 0;
+  for (const IntermediatePair &pair: vec2)
+  {
+    // a new segment starts at the first pair that isn't below its splitter
+    while (run.segment_offsets.size () <= job->splitters.size ()
+           && !(*pair.first < *job->splitters[run.segment_offsets.size () - 1]))
+    {
+      run.segment_offsets.push_back (offset);
+    }
+    record.resize (sizeof (uint32_t));
+    serializer->serialize (pair.first, pair.second, record);
+    uint32_t record_size = (uint32_t) (record.size () - sizeof (uint32_t));
+    memcpy (&record[0], &record_size, sizeof (record_size));
+    append_run_bytes (&run, buffer, record.data (), record.size (), offset);
+    delete pair.first;
+    delete pair.second;
+  }
+  write_all (run.fd, buffer);
+  while (run.segment_offsets.size () <= job->splitters.size () + 1)
+  {
+    run.segment_offsets.push_back (offset);
+  }
+
+  cur_context->spill_runs.push_back (run);
+  vec2.clear ();
+  cur_context->buffered_pairs = 0;
+  *job->spilled = true;
+  compact_spill_runs (context);
+}
 
-struct ThreadContext
+bool fill_cursor (SpillCursor *cursor, uint64_t needed)
 {
-    Job *job;
-    IntermediateVec thread_vec = {};
-    unsigned int thread_id;
-};
-
-struct Job
-{
-    /////////// VARIABLES ///////////
-    const MapReduceClient *client;
-    const InputVec *inputVec;
-    int input_vec_size;
-    OutputVec *outputVec;
-    vec_queue shuffle_vector;
-    int shuffled_vec_size = 0;
-    int multiThreadLevel;
-    pthread_t *threads;
-    ThreadContext *thread_contexts;
-    Barrier *barrier;
-    keys_set ordered_keys;
-    bool called_wait = false;
-
-    /////////// ATOMIC ///////////
-    atomic_int *ac_num_input_items;
-    atomic_int *ac_num_inter_pairs;
-    atomic_int *ac_num_vec_in_queue;
-    atomic_int *ac_num_reduced_pairs;
-    atomic_int_64 *atomic_state;
-
-    /////////// MUTEXES ///////////
-    pthread_mutex_t update_atomic_mutex;
-    pthread_mutex_t emit2_mutex;
-    pthread_mutex_t emit3_mutex;
-    pthread_mutex_t reduce_mutex;
-};
+  uint64_t available = cursor->buffer_end - cursor->buffer_begin;
+  if (available >= needed)
+  {
+    return true;
+  }
+  uint64_t file_left = cursor->file_end - cursor->file_offset;
+  if (available + file_left < needed)
+  {
+    return false;
+  }
 
-/////////// FUNCTIONS ///////////
+  // small segments get small buffers, so merging many runs stays cheap
+  std::vector<char> &buffer = cursor->buffer;
+  std::copy (buffer.begin () + cursor->buffer_begin,
+             buffer.begin () + cursor->buffer_end, buffer.begin ());
+  cursor->buffer_begin = 0;
+  cursor->buffer_end = available;
+  uint64_t buffer_size = std::max (needed, std::min (
+      available + file_left, (uint64_t) SPILL_IO_BUFFER));
+  if (buffer.size () < buffer_size)
+  {
+    buffer.resize (buffer_size);
+  }
+  while (cursor->buffer_end < needed)
+  {
+    uint64_t to_read = std::min (
+        buffer.size () - cursor->buffer_end,
+        cursor->file_end - cursor->file_offset);
+    ssize_t cur_read = pread (cursor->fd,
+                              buffer.data () + cursor->buffer_end,
+                              to_read, cursor->file_offset);
+    check_system_error (cur_read <= 0);
+    cursor->buffer_end += cur_read;
+    cursor->file_offset += cur_read;
+  }
+  return true;
+}
 
-void check_system_error (int indicator)
+bool next_spilled_pair (void *context, SpillCursor *cursor)
 {
-  if (indicator)
+  ThreadContext *cur_context = (ThreadContext *) context;
+  if (!fill_cursor (cursor, sizeof (uint32_t)))
   {
-    std::cout << SYSTEM_ERROR << std::endl;
-    exit (1);
+    return false;
   }
+  uint32_t record_size = 0;
+  memcpy (&record_size,
+          cursor->buffer.data () + cursor->buffer_begin,
+          sizeof (record_size));
+  check_system_error (!fill_cursor (cursor,
+                                    sizeof (record_size) + record_size));
+  cursor->record_begin = cursor->buffer_begin;
+  const char *record = cursor->buffer.data () + cursor->buffer_begin
+                       + sizeof (record_size);
+  cursor->pair = cur_context->job->options.spill_serializer
+      ->deserialize (record, record_size);
+  cursor->buffer_begin += sizeof (record_size) + record_size;
+  return true;
 }
 
-bool
-pair_sort_inter (const IntermediatePair &pair1, const IntermediatePair &pair2)
+void open_cursors (void *context, std::vector<SpillRun> &runs,
+                   unsigned int segment, std::vector<SpillCursor> &cursors,
+                   cursor_heap &heap)
 {
-  return (*pair1.first) < (*pair2.first);
+  for (const SpillRun &run: runs)
+  {
+    SpillCursor cursor;
+    cursor.fd = run.fd;
+    cursor.file_offset = run.segment_offsets[segment];
+    cursor.file_end = run.segment_offsets[segment + 1];
+    if (cursor.file_end > cursor.file_offset)
+    {
+      cursors.push_back (cursor);
+    }
+  }
+  // the cursors aren't moved anymore, so the heap can point at them
+  for (SpillCursor &cursor: cursors)
+  {
+    if (next_spilled_pair (context, &cursor))
+    {
+      heap.push (&cursor);
+    }
+  }
 }
 
-void update_atomic_counter (JobHandle job, stage_t stage, int counter)
+void merge_runs (void *context, std::vector<SpillRun> &runs,
+                 SpillRun *merged)
 {
-  Job *cur_job = (Job *) job;
-  int64_t stage_shifted = (int64_t) stage << 62;
-  int64_t total = 0;
-  switch (stage)
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  open_run (context, merged);
+  merged->level = runs.front ().level + 1;
+  merged->segment_offsets.clear ();
+  std::string buffer;
+  uint64_t offset = 0;
+  for (int segment = 0; segment < job->multiThreadLevel; ++segment)
   {
-    case UNDEFINED_STAGE:
-      break;
-    case MAP_STAGE:
-      if (counter >= cur_job->input_vec_size)
-      {
-        counter = cur_job->input_vec_size;
-      }
-      total = (int64_t) (cur_job->input_vec_size) << 31;
-      break;
-    default:
-      if (counter >= *cur_job->ac_num_inter_pairs)
+    merged->segment_offsets.push_back (offset);
+    std::vector<SpillCursor> cursors;
+    cursor_heap heap;
+    open_cursors (context, runs, segment, cursors, heap);
+    while (!heap.empty ())
+    {
+      // the record's bytes are copied as they are, the pair read from them
+      // was only needed to order it
+      SpillCursor *cursor = heap.top ();
+      heap.pop ();
+      append_run_bytes (merged, buffer,
+                        cursor->buffer.data () + cursor->record_begin,
+                        cursor->buffer_begin - cursor->record_begin, offset);
+      delete cursor->pair.first;
+      delete cursor->pair.second;
+      if (next_spilled_pair (context, cursor))
       {
-        counter = *cur_job->ac_num_inter_pairs;
+        heap.push (cursor);
       }
-      total = (int64_t) (*cur_job->ac_num_inter_pairs) << 31;
-      break;
+    }
+  }
+  merged->segment_offsets.push_back (offset);
+  write_all (merged->fd, buffer);
+
+  for (const SpillRun &run: runs)
+  {
+    close (run.fd);
   }
-  int64_t value = stage_shifted | total | (int64_t) counter;
-  *(cur_job->atomic_state) = value;
 }
 
-void threads_map_phase (void *context)
+void compact_spill_runs (void *context)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
-  int input_vec_size = (int) cur_context->job->inputVec->size ();
-  bool finish_processing = false;
-  while (!finish_processing)
+  std::vector<SpillRun> &thread_runs = cur_context->spill_runs;
+  while (thread_runs.size () >= SPILL_MERGE_FAN_IN)
   {
-    int old_value = (*(cur_context->job->ac_num_input_items))++;
-    if (old_value >= input_vec_size)
-    {
-      finish_processing = true;
-    }
-    else
+    int level = thread_runs.back ().level;
+    std::vector<SpillRun>::iterator first_run =
+        thread_runs.end () - SPILL_MERGE_FAN_IN;
+    for (std::vector<SpillRun>::iterator it = first_run;
+         it != thread_runs.end (); ++it)
     {
-      int lock_success = pthread_mutex_lock
-          (&cur_context->job->update_atomic_mutex);
-      check_system_error (lock_success);
-      update_atomic_counter (cur_context->job, MAP_STAGE,
-                             (*(cur_context->job->ac_num_input_items)));
-      int unlock_success = pthread_mutex_unlock
-          (&cur_context->job->update_atomic_mutex);
-      check_system_error (unlock_success);
-      const InputPair &cur_pair = (*(cur_context->job->inputVec))[old_value];
-      cur_context->job->client->map (cur_pair.first, cur_pair.second, context);
+      if (it->level != level)
+      {
+        return;
+      }
     }
+    std::vector<SpillRun> runs (first_run, thread_runs.end ());
+    thread_runs.erase (first_run, thread_runs.end ());
+    SpillRun merged;
+    merge_runs (context, runs, &merged);
+    thread_runs.push_back (merged);
   }
 }
 
-void shuffle (void *context)
+void reduce_group (void *context, IntermediateVec &group)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  if (job->view_reducer != nullptr)
+  {
+    job->view_reducer->reduce_view (group.data (), group.size (), context);
+  }
+  else
+  {
+    job->client->reduce (&group, context);
+  }
+  cur_context->stats.pairs_reduced += group.size ();
+  cur_context->stats.groups_reduced++;
+  cur_context->largest_group =
+      std::max (cur_context->largest_group, (uint64_t) group.size ());
+  report_progress (context, group.size ());
+  group.clear ();
+}
+
+void merge_spill_runs (void *context)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
-  int num_processed_pairs = 0;
-  for (K2 *cur_key: cur_context->job->ordered_keys)
+  Job *job = cur_context->job;
+  std::vector<SpillRun> runs;
+  for (int i = 0; i < job->multiThreadLevel; ++i)
+  {
+    std::vector<SpillRun> &thread_runs = job->thread_contexts[i].spill_runs;
+    runs.insert (runs.end (), thread_runs.begin (), thread_runs.end ());
+  }
+  std::vector<SpillCursor> cursors;
+  cursor_heap heap;
+  open_cursors (context, runs, cur_context->thread_id, cursors, heap);
+
+  IntermediateVec group;
+  uint64_t threshold = job->options.split_reduce_threshold;
+  while (!heap.empty ())
   {
-    IntermediateVec *cur_key_vec = new IntermediateVec;
-    for (int i = 0; i < cur_context->job->multiThreadLevel; ++i)
+    SpillCursor *cursor = heap.top ();
+    heap.pop ();
+    if (!group.empty () && *group.front ().first < *cursor->pair.first)
     {
-      IntermediateVec &vec2 = cur_context->job->thread_contexts[i].thread_vec;
-      int vec_size = (int) vec2.size ();
-      for (int j = 0; j < vec_size; ++j)
-      {
-        if ((*vec2.back ().first) < *cur_key
-            || *cur_key < (*(vec2.back ().first)))
-        {
-          break;
-        }
-        cur_key_vec->push_back (vec2.back ());
-        num_processed_pairs++;
-        update_atomic_counter (cur_context->job, SHUFFLE_STAGE,
-                               num_processed_pairs);
-        vec2.pop_back ();
-      }
+      reduce_group (context, group);
+    }
+    group.push_back (cursor->pair);
+    if (threshold != 0 && group.size () == threshold)
+    {
+      reduce_group (context, group);
+    }
+    if (next_spilled_pair (context, cursor))
+    {
+      heap.push (cursor);
     }
-    cur_context->job->shuffle_vector.push_back (cur_key_vec);
   }
+  if (!group.empty ())
+  {
+    reduce_group (context, group);
+  }
+  flush_progress (context);
 }
 
-void *thread_func (void *context)
+void sort_shuffle_reduce (void *context)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
 
-  // MAP
-  threads_map_phase (context);
-
   // SORT
-  std::sort (cur_context->thread_vec.begin (),
-             cur_context->thread_vec.end (), pair_sort_inter);
-  cur_context->job->barrier->barrier ();
+  enter_phase (context, SORT_PHASE);
+  bool sorted_grouping = cur_context->job->options.grouping == SORTED_GROUPING;
+  if (cur_context->job->combiner != nullptr)
+  {
+    combine_buffer (context);
+  }
+  else if (sorted_grouping)
+  {
+    std::sort (cur_context->thread_vec.begin (),
+               cur_context->thread_vec.end (), pair_sort_inter);
+  }
+  wait_barrier (context);
 
   // SHUFFLE
+  enter_phase (context, SHUFFLE_PHASE);
   if (cur_context->thread_id == 0)
   {
     update_atomic_counter (cur_context->job, SHUFFLE_STAGE, 0);
+    size_shuffle_arena (context);
+  }
+  if (sorted_grouping)
+  {
+    choose_splitter (context);
+  }
+  wait_barrier (context);
+  if (sorted_grouping)
+  {
     shuffle (context);
-    cur_context->job->shuffled_vec_size =
-        (int) cur_context->job->shuffle_vector.size ();
+  }
+  else
+  {
+    hash_shuffle (context);
+  }
+  // every thread starts reducing its own part of the shuffle arena
+  WorkRange &reduce_range =
+      cur_context->job->reduce_ranges[cur_context->thread_id];
+  reduce_range.part = (int) cur_context->thread_id;
+  reduce_range.begin = 0;
+  reduce_range.end =
+      cur_context->job->shuffle_groups[cur_context->thread_id].size () - 1;
+  wait_barrier (context);
+
+  // all the pairs are in the arena now
+  IntermediateVec ().swap (cur_context->thread_vec);
+  std::vector<IntermediateVec> ().swap (cur_context->partitions);
+  if (cur_context->thread_id == 0)
+  {
     update_atomic_counter (cur_context->job, REDUCE_STAGE, 0);
   }
-  cur_context->job->barrier->barrier ();
+  wait_barrier (context);
 
   // REDUCE
+  enter_phase (context, REDUCE_PHASE);
   threads_reduce_phase (context);
+}
+
+void spilled_shuffle_reduce (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+
+  // SPILL, the sort of the pairs still in memory
+  enter_phase (context, SORT_PHASE);
+  if (!cur_context->thread_vec.empty ())
+  {
+    spill_buffer (context);
+  }
+  wait_barrier (context);
+
+  // SHUFFLE
+  enter_phase (context, SHUFFLE_PHASE);
+  if (cur_context->thread_id == 0)
+  {
+    // the runs are already cut by key range, nothing is left to shuffle
+    update_atomic_counter (job, SHUFFLE_STAGE, *job->ac_num_inter_pairs);
+    update_atomic_counter (job, REDUCE_STAGE, 0);
+  }
+  wait_barrier (context);
+
+  // REDUCE
+  enter_phase (context, REDUCE_PHASE);
+  merge_spill_runs (context);
+}
+
+void *thread_func (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  enter_job_thread ();
+  cur_context->thread_begin = now_seconds () - cur_context->job->start_time;
+
+  // MAP
+  enter_phase (context, MAP_PHASE);
+  threads_map_phase (context);
+  sample_buffer_bytes (context);
+
+  // once any thread spilled, all the pairs of the job go through run files
+  bool spilled = false;
+  if (cur_context->job->spill_enabled)
+  {
+    wait_barrier (context);
+    spilled = *cur_context->job->spilled;
+  }
+  if (spilled)
+  {
+    spilled_shuffle_reduce (context);
+  }
+  else
+  {
+    sort_shuffle_reduce (context);
+  }
+
+  // OUTPUT
+  if (cur_context->job->options.output_sink == nullptr)
+  {
+    wait_barrier (context);
+    enter_phase (context, OUTPUT_PHASE);
+    splice_output (context);
+  }
+  enter_phase (context, NUM_JOB_PHASES);
+  cur_context->thread_end = now_seconds () - cur_context->job->start_time;
+  leave_job_thread ();
 
   return 0;
 }
 
+double now_seconds ()
+{
+  struct timespec now;
+  int clock_success = clock_gettime (CLOCK_MONOTONIC, &now);
+  check_system_error (clock_success);
+  return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+void enter_phase (void *context, int phase)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  double now = now_seconds () - cur_context->job->start_time;
+  int cur_phase = cur_context->cur_phase;
+  if (cur_phase != NUM_JOB_PHASES)
+  {
+    cur_context->stats.phase_seconds[cur_phase] +=
+        now - cur_context->phase_begin;
+    cur_context->last_end[cur_phase] = now;
+  }
+  if (phase != NUM_JOB_PHASES && cur_context->first_begin[phase] < 0)
+  {
+    cur_context->first_begin[phase] = now;
+  }
+  cur_context->cur_phase = phase;
+  cur_context->phase_begin = now;
+}
+
+void wait_barrier (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  // the wait splits the current phase in two, the phase continues after it
+  int phase = cur_context->cur_phase;
+  enter_phase (context, NUM_JOB_PHASES);
+  double wait_begin = cur_context->phase_begin;
+  cur_context->job->barrier->barrier ();
+  enter_phase (context, phase);
+  cur_context->stats.barrier_wait_seconds +=
+      cur_context->phase_begin - wait_begin;
+}
+
+void lock_range (void *context, pthread_mutex_t *mutex)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  // an uncontended lock costs no clock reading
+  int lock_success = pthread_mutex_trylock (mutex);
+  if (lock_success == EBUSY)
+  {
+    double wait_begin = now_seconds ();
+    lock_success = pthread_mutex_lock (mutex);
+    cur_context->stats.lock_wait_seconds += now_seconds () - wait_begin;
+  }
+  check_system_error (lock_success);
+}
+
+void sample_buffer_bytes (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  uint64_t num_pairs = cur_context->thread_vec.capacity ()
+                       + cur_context->combine_run.capacity ();
+  for (const IntermediateVec &partition: cur_context->partitions)
+  {
+    num_pairs += partition.capacity ();
+  }
+  cur_context->peak_buffer_bytes =
+      std::max (cur_context->peak_buffer_bytes,
+                num_pairs * sizeof (IntermediatePair));
+}
+
 void threads_reduce_phase (void *context)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
-  vec_queue &shuffle_vec = cur_context->job->shuffle_vector;
-  bool finish_processing = false;
-  while (!finish_processing)
+  Job *job = cur_context->job;
+  int part = 0;
+  uint64_t first = 0;
+  uint64_t last = 0;
+  while (claim_chunk (context, job->reduce_ranges, part, first, last))
   {
-    int old_value = (*(cur_context->job->ac_num_vec_in_queue))++;
-    if (old_value >= cur_context->job->shuffled_vec_size)
-    {
-      finish_processing = true;
-    }
-    else
+    offsets_vec &groups = job->shuffle_groups[part];
+    for (uint64_t i = first; i < last; ++i)
     {
-      const IntermediateVec *cur_vec_to_reduce = shuffle_vec[old_value];
-      cur_context->job->client->reduce (cur_vec_to_reduce, context);
-      atomic_int *&counter = cur_context->job->ac_num_reduced_pairs;
-      int lock_success = pthread_mutex_lock (&cur_context->job->reduce_mutex);
-      check_system_error (lock_success);
-      int cur_num_pairs = (int) cur_vec_to_reduce->size ();
-      *counter += cur_num_pairs;
-      update_atomic_counter (cur_context->job, REDUCE_STAGE, *counter);
-      int unlock_success = pthread_mutex_unlock (&cur_context->job->reduce_mutex);
-      check_system_error (unlock_success);
+      uint64_t cur_num_pairs = groups[i + 1] - groups[i];
+      reduce_pairs (context, job->shuffle_arena + groups[i], cur_num_pairs);
+      report_progress (context, cur_num_pairs);
     }
   }
+  flush_progress (context);
 }
 
-void emit3 (K3 *key, V3 *value, void *context)
+void reduce_pairs (void *context, const IntermediatePair *pairs,
+                   uint64_t num_pairs)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  if (job->view_reducer != nullptr)
+  {
+    job->view_reducer->reduce_view (pairs, num_pairs, context);
+  }
+  else
+  {
+    // the vector keeps its capacity, so it is allocated only while it grows
+    IntermediateVec &scratch = cur_context->reduce_scratch;
+    scratch.assign (pairs, pairs + num_pairs);
+    job->client->reduce (&scratch, context);
+  }
+  cur_context->stats.pairs_reduced += num_pairs;
+  cur_context->stats.groups_reduced++;
+  cur_context->largest_group =
+      std::max (cur_context->largest_group, num_pairs);
+}
 
-  int lock_success = pthread_mutex_lock (&cur_context->job->emit3_mutex);
-  check_system_error (lock_success);
-  (*(cur_context->job->outputVec)).emplace_back (std::make_pair (key, value));
-  int unlock_success = pthread_mutex_unlock (&cur_context->job->emit3_mutex);
-  check_system_error (unlock_success);
+void emit3 (K3 *key, V3 *value, void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  if (cur_context->job->process_execution)
+  {
+    process_emit3 (context, key, value);
+    return;
+  }
+  OutputSink *sink = cur_context->job->options.output_sink;
+  cur_context->stats.pairs_output++;
+  if (sink != nullptr)
+  {
+    sink->consume ((int) cur_context->thread_id, key, value);
+    return;
+  }
+  cur_context->output_buffer.emplace_back (std::make_pair (key, value));
 }
 
 void emit2 (K2 *key, V2 *value, void *context)
 {
   ThreadContext *cur_context = (ThreadContext *) context;
-  int lock_success = pthread_mutex_lock (&cur_context->job->emit2_mutex);
-  check_system_error (lock_success);
-  keys_set &set_keys = cur_context->job->ordered_keys;
-  if (set_keys.find (key) == set_keys.end ())
+  if (cur_context->job->process_execution)
+  {
+    process_emit2 (context, key, value);
+    return;
+  }
+  if (cur_context->job->options.grouping == HASH_GROUPING)
+  {
+    // thread local partitions, grouped by hash in the shuffle
+    std::size_t p = key_hash () (key) % cur_context->job->num_partitions;
+    cur_context->partitions[p].emplace_back (std::make_pair (key, value));
+  }
+  else
   {
-    set_keys.insert (key);
+    // keys are grouped by merging the sorted thread vectors in the shuffle
+    cur_context->thread_vec.emplace_back (std::make_pair (key, value));
   }
-  cur_context->thread_vec.emplace_back (std::make_pair (key, value));
+  cur_context->stats.pairs_emitted++;
   (*cur_context->job->ac_num_inter_pairs)++;
-  int unlock_success = pthread_mutex_unlock (&cur_context->job->emit2_mutex);
-  check_system_error (unlock_success);
+  if (cur_context->job->combiner != nullptr
+      && ++cur_context->buffered_pairs >= cur_context->combine_threshold)
+  {
+    combine_buffer (context);
+  }
+  if (cur_context->job->spill_enabled && cur_context->thread_vec.size ()
+      >= cur_context->job->options.spill_pair_budget)
+  {
+    spill_buffer (context);
+  }
 }
 
 JobHandle startMapReduceJob (const MapReduceClient &client,
                              const InputVec &inputVec, OutputVec &outputVec,
                              int multiThreadLevel)
+{
+  return startMapReduceJob (client, inputVec, outputVec, multiThreadLevel,
+                            JobOptions ());
+}
+
+JobHandle startMapReduceJob (const MapReduceClient &client,
+                             const InputVec &inputVec, OutputVec &outputVec,
+                             int multiThreadLevel, const JobOptions &options)
+{
+  return start_job (client, &inputVec, nullptr, outputVec, multiThreadLevel,
+                    options);
+}
+
+JobHandle startMapReduceJob (const MapReduceClient &client,
+                             InputSource &source, OutputVec &outputVec,
+                             int multiThreadLevel, const JobOptions &options)
+{
+  source.start (multiThreadLevel);
+  return start_job (client, nullptr, &source, outputVec, multiThreadLevel,
+                    options);
+}
+
+JobHandle start_job (const MapReduceClient &client, const InputVec *inputVec,
+                     InputSource *source, OutputVec &outputVec,
+                     int multiThreadLevel, const JobOptions &options)
 {
   Job *job = new Job;
+  job->start_time = now_seconds ();
   ThreadContext *thread_contexts = new ThreadContext[multiThreadLevel];
-  pthread_t *threads = new pthread_t[multiThreadLevel];
   Barrier *barrier = new Barrier (multiThreadLevel);
+  WorkRange *map_ranges = new WorkRange[multiThreadLevel];
+  WorkRange *reduce_ranges = new WorkRange[multiThreadLevel];
+  for (int i = 0; i < multiThreadLevel; ++i)
+  {
+    int init_success = pthread_mutex_init (&map_ranges[i].mutex, NULL);
+    check_system_error (init_success);
+    init_success = pthread_mutex_init (&reduce_ranges[i].mutex, NULL);
+    check_system_error (init_success);
+  }
 
-  atomic_int *ac_num_input_items = new atomic_int (0);
-  atomic_int *ac_num_inter_pairs = new atomic_int (0);
-  atomic_int *ac_num_reduced_pairs = new atomic_int (0);
-  atomic_int *ac_num_vec_in_queue = new atomic_int (0);
-  atomic_int_64 *atomic_counter_state = new atomic_int_64 (0);
+  atomic_uint_64 *ac_num_inter_pairs = new atomic_uint_64 (0);
+  atomic_int *atomic_stage = new atomic_int (UNDEFINED_STAGE);
+  atomic_uint_64 *stage_counters = new atomic_uint_64[NUM_STAGES] ();
+  atomic_bool *spilled = new atomic_bool (false);
+  atomic_bool *failed = new atomic_bool (false);
 
-  pthread_mutex_t emit2_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_t emit3_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_t update_atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_t reduce_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_t spill_mutex = PTHREAD_MUTEX_INITIALIZER;
 
   job->client = &client;
-  job->inputVec = &inputVec;
-  job->input_vec_size = (int) inputVec.size ();
+  job->combiner = dynamic_cast<const CombinerClient *> (&client);
+  job->view_reducer = dynamic_cast<const ViewReduceClient *> (&client);
+  job->options = options;
+  job->inputVec = inputVec;
+  job->input_source = source;
+  if (inputVec != nullptr)
+  {
+    job->input_vec_size = inputVec->size ();
+  }
+  else
+  {
+    // map progress of a source of unknown size stays near 0 until the
+    // shuffle starts
+    job->input_vec_size = source->size () > 0 ? source->size () : UINT64_MAX;
+  }
   job->outputVec = &outputVec;
   job->multiThreadLevel = multiThreadLevel;
-  job->threads = threads;
+  job->shuffle_groups.resize (multiThreadLevel);
+  job->splitters.resize (multiThreadLevel - 1);
+  job->num_partitions = multiThreadLevel * PARTITIONS_PER_THREAD;
+  job->spill_enabled = options.spill_serializer != nullptr
+                       && options.spill_pair_budget > 0
+                       && options.grouping == SORTED_GROUPING;
   job->thread_contexts = thread_contexts;
+  job->map_ranges = map_ranges;
+  job->reduce_ranges = reduce_ranges;
   job->barrier = barrier;
-  job->ac_num_input_items = ac_num_input_items;
   job->ac_num_inter_pairs = ac_num_inter_pairs;
-  job->ac_num_vec_in_queue = ac_num_vec_in_queue;
-  job->ac_num_reduced_pairs = ac_num_reduced_pairs;
-  job->atomic_state = atomic_counter_state;
-  job->update_atomic_mutex = update_atomic_mutex;
-  job->emit2_mutex = emit2_mutex;
-  job->emit3_mutex = emit3_mutex;//
-  job->reduce_mutex = reduce_mutex;
+  job->atomic_stage = atomic_stage;
+  job->stage_counters = stage_counters;
+  job->spilled = spilled;
+  job->failed = failed;
+  job->process_execution = options.process_serializer != nullptr
+                           && inputVec != nullptr;
+  job->spill_mutex = spill_mutex;
+  update_atomic_counter (job, MAP_STAGE, 0);
+  thread_contexts[0].job = job;
+  init_work_ranges (thread_contexts, map_ranges,
+                    inputVec != nullptr ? job->input_vec_size : 0);
 
+  std::vector<void *> contexts (multiThreadLevel);
   for (int i = 0; i < multiThreadLevel; ++i)
   {
     thread_contexts[i].job = job;
     thread_contexts[i].thread_id = i;
-    int create_success = pthread_create (
-        threads + i, NULL, thread_func, thread_contexts + i);
-    check_system_error (create_success);
+    std::fill (thread_contexts[i].first_begin,
+               thread_contexts[i].first_begin + NUM_JOB_PHASES, -1.0);
+    std::fill (thread_contexts[i].last_end,
+               thread_contexts[i].last_end + NUM_JOB_PHASES, 0.0);
+    if (options.grouping == HASH_GROUPING)
+    {
+      thread_contexts[i].partitions.resize (job->num_partitions);
+    }
+    contexts[i] = thread_contexts + i;
   }
+  if (job->process_execution)
+  {
+    // a single thread coordinates the worker processes
+    job->gang = ThreadPool::shared ().runGang (1, run_process_job,
+                                               contexts.data ());
+    return job;
+  }
+  // pooled workers replace creating the job's threads
+  job->gang = ThreadPool::shared ().runGang (multiThreadLevel, thread_func,
+                                             contexts.data ());
   return job;
 }
 
@@ -367,18 +1848,18 @@ void waitForJob (JobHandle job)
   {
     return;
   }
-  for (int i = 0; i < cur_job->multiThreadLevel; ++i)
-  {
-    int joined_success = pthread_join (cur_job->threads[i], NULL);
-    check_system_error (joined_success);
-  }
+  ThreadPool::shared ().waitGang (cur_job->gang);
   cur_job->called_wait = true;
 }
 
 void getJobState (JobHandle job, JobState *state)
 {
   Job *cur_job = (Job *) job;
-  if (*cur_job->atomic_state == UNDEFINED_STAGE)
+  // the stage's total is stored before the stage is published and only
+  // this stage's items are added to its counter, which never passes the
+  // total, so the three values always make a consistent snapshot
+  stage_t stage = (stage_t) cur_job->atomic_stage->load ();
+  if (stage == UNDEFINED_STAGE)
   {
     state->stage = UNDEFINED_STAGE;
     state->percentage = 0;
@@ -386,43 +1867,112 @@ void getJobState (JobHandle job, JobState *state)
   }
   else
   {
-    int64_t atomic_state = *cur_job->atomic_state;
-    int64_t lsb_31_mask = 0x7FFFFFFF;  // Mask with the first 31 bits set to 1
-    int64_t counter = (atomic_state & lsb_31_mask);
-    int64_t shifts_31 = atomic_state >> 31;
-    int64_t total = shifts_31 & lsb_31_mask;
-    state->percentage = (float) (counter * 100) / (float) total;
-    int64_t stage_mask = 0x03;
-    state->stage = (stage_t) ((shifts_31 >> 31) & stage_mask);
+    uint64_t total = cur_job->stage_totals[stage];
+    uint64_t counter = cur_job->stage_counters[stage].load ();
+    // a stage without any item to process is already done
+    state->percentage = total == 0 ? 100 : (float) (
+        (double) counter * 100 / (double) total);
+    state->stage = stage;
+  }
+}
+
+void getJobStats (JobHandle job, JobStats *stats)
+{
+  waitForJob (job);
+  Job *cur_job = (Job *) job;
+  stats->total_seconds = 0;
+  stats->intermediate_pairs = *cur_job->ac_num_inter_pairs;
+  stats->largest_group = 0;
+  stats->peak_intermediate_bytes = cur_job->arena_bytes;
+  stats->threads.resize (cur_job->multiThreadLevel);
+  for (int i = 0; i < cur_job->multiThreadLevel; ++i)
+  {
+    const ThreadContext &thread = cur_job->thread_contexts[i];
+    stats->total_seconds = std::max (stats->total_seconds, thread.thread_end);
+    stats->largest_group = std::max (stats->largest_group,
+                                     thread.largest_group);
+    stats->peak_intermediate_bytes += thread.peak_buffer_bytes;
+  }
+  for (int p = 0; p < NUM_JOB_PHASES; ++p)
+  {
+    double first_begin = -1;
+    double last_end = 0;
+    for (int i = 0; i < cur_job->multiThreadLevel; ++i)
+    {
+      double thread_begin = cur_job->thread_contexts[i].first_begin[p];
+      if (thread_begin >= 0 && (first_begin < 0 || thread_begin < first_begin))
+      {
+        first_begin = thread_begin;
+      }
+      last_end = std::max (last_end, cur_job->thread_contexts[i].last_end[p]);
+    }
+    stats->phase_seconds[p] = first_begin < 0 ? 0 : last_end - first_begin;
+  }
+  for (int i = 0; i < cur_job->multiThreadLevel; ++i)
+  {
+    ThreadStats &thread_stats = stats->threads[i];
+    thread_stats = cur_job->thread_contexts[i].stats;
+    thread_stats.busy_seconds = 0;
+    for (int p = 0; p < NUM_JOB_PHASES; ++p)
+    {
+      thread_stats.busy_seconds += thread_stats.phase_seconds[p];
+    }
+    thread_stats.idle_seconds = std::max (
+        0.0, stats->total_seconds - thread_stats.busy_seconds
+             - thread_stats.barrier_wait_seconds);
   }
 }
 
+const char *getJobError (JobHandle job)
+{
+  Job *cur_job = (Job *) job;
+  return *cur_job->failed ? cur_job->error.c_str () : nullptr;
+}
+
 void closeJobHandle (JobHandle job)
 {
   waitForJob (job);
   Job *cur_job = (Job *) job;
 
   // release atomic counters & barrier
-  delete cur_job->ac_num_input_items;
   delete cur_job->ac_num_inter_pairs;
-  delete cur_job->ac_num_reduced_pairs;
-  delete cur_job->ac_num_vec_in_queue;
-  delete cur_job->atomic_state;
+  delete cur_job->atomic_stage;
+  delete[] cur_job->stage_counters;
   delete cur_job->barrier;
 
-  // release vector pointers in shuffle vector
-  for (int i = 0; i < cur_job->shuffled_vec_size; ++i)
+  // release the shuffle arena, its pairs need no destruction
+  ::operator delete (cur_job->shuffle_arena);
+
+  // release run files and the splitter copies of a spilled job
+  for (int i = 0; i < cur_job->multiThreadLevel; ++i)
+  {
+    for (const SpillRun &run: cur_job->thread_contexts[i].spill_runs)
+    {
+      close (run.fd);
+    }
+  }
+  if (*cur_job->spilled)
   {
-    delete cur_job->shuffle_vector[i];
+    for (K2 *splitter: cur_job->splitters)
+    {
+      delete splitter;
+    }
   }
+  delete cur_job->spilled;
+  delete cur_job->failed;
 
-  pthread_mutex_destroy (&cur_job->update_atomic_mutex);
-  pthread_mutex_destroy (&cur_job->emit2_mutex);
-  pthread_mutex_destroy (&cur_job->emit3_mutex);
-  pthread_mutex_destroy (&cur_job->reduce_mutex);
+  pthread_mutex_destroy (&cur_job->spill_mutex);
+
+  // release work ranges
+  for (int i = 0; i < cur_job->multiThreadLevel; ++i)
+  {
+    pthread_mutex_destroy (&cur_job->map_ranges[i].mutex);
+    pthread_mutex_destroy (&cur_job->reduce_ranges[i].mutex);
+  }
+  delete[] cur_job->map_ranges;
+  delete[] cur_job->reduce_ranges;
 
-  // release threads arrays
-  delete[] cur_job->threads;
+  // release threads array
   delete[] cur_job->thread_contexts;
 
   // release job
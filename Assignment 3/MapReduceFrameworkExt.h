@@ -0,0 +1,269 @@
+#ifndef MAPREDUCEFRAMEWORKEXT_H
+#define MAPREDUCEFRAMEWORKEXT_H
+
+#include "MapReduceFramework.h"
+#include "InputSource.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * the way intermediate pairs are grouped into the vectors passed to reduce.
+ * SORTED_GROUPING sorts the pairs by key 2 and hands the groups to reduce
+ * through an ordered shuffle. HASH_GROUPING only gathers equal keys together
+ * by their hash, without sorting, and requires every key 2 emitted by the
+ * client to derive from HashableK2.
+ */
+enum grouping_t
+{
+    SORTED_GROUPING = 0,
+    HASH_GROUPING = 1
+};
+
+/**
+ * key 2 that can be grouped by hash instead of by order.
+ * Keys that are equal must return the same hash.
+ */
+class HashableK2 : public K2
+{
+ public:
+  virtual std::size_t hash () const = 0;
+  virtual bool equals (const K2 &other) const = 0;
+};
+
+/**
+ * client with a combine stage. A job started with a CombinerClient folds
+ * the pairs every thread emitted for the same key before the shuffle, while
+ * they are buffered and once more after the thread's last map, so
+ * intermediate memory and shuffle work grow with the distinct keys of each
+ * thread instead of with the number of emit2 calls.
+ * combine gets two or more pairs sharing one key and returns a single value
+ * folding all their values. The framework keeps the first pair's key with
+ * the returned value and forgets all the other pairs, so combine may delete
+ * their keys and values, as well as the first pair's value.
+ * A value returned by combine may later be combined again.
+ */
+class CombinerClient : public MapReduceClient
+{
+ public:
+  virtual V2 *combine (const IntermediateVec *pairs) const = 0;
+};
+
+/**
+ * client that reduces the shuffled groups in place. A job started with a
+ * ViewReduceClient calls reduce_view instead of reduce, with the pairs of
+ * one group as [pairs, pairs + num_pairs) inside the job's shuffle arena,
+ * so no vector is filled per group. The framework never calls reduce of
+ * such a client.
+ */
+class ViewReduceClient : public MapReduceClient
+{
+ public:
+  virtual void reduce_view (const IntermediatePair *pairs,
+                            std::size_t num_pairs, void *context) const = 0;
+};
+
+/**
+ * receives the output pairs of a job as soon as reduce emits them, instead
+ * of having them collected into the output vector. consume is called by all
+ * the worker threads concurrently, worker_id is the calling thread's index
+ * in [0, multiThreadLevel) so a sink can keep per-thread state without
+ * locking.
+ */
+class OutputSink
+{
+ public:
+  virtual ~OutputSink () {}
+  virtual void consume (int worker_id, K3 *key, V3 *value) = 0;
+};
+
+/**
+ * writes intermediate pairs to bytes and reads them back, used by jobs that
+ * spill their intermediate pairs to disk.
+ * serialize appends the bytes of a pair to out. Once a pair is written the
+ * framework deletes its key and value, so keys and values of spilled jobs
+ * must not be shared between pairs.
+ * deserialize rebuilds a pair from the bytes serialize wrote for it. The
+ * rebuilt pairs are passed to reduce exactly like emitted pairs are.
+ */
+class PairSerializer
+{
+ public:
+  virtual ~PairSerializer () {}
+  virtual void serialize (const K2 *key, const V2 *value,
+                          std::string &out) const = 0;
+  virtual IntermediatePair deserialize (const char *data,
+                                        std::size_t size) const = 0;
+};
+
+/**
+ * writes the keys and values of a job running in worker processes to bytes
+ * and reads them back, so they can move between the processes.
+ * Intermediate pairs are partitioned between the workers by a hash of their
+ * key's bytes, so equal keys 2 must serialize to equal bytes. The serialize
+ * functions append to out, and the keys and values a worker emitted are
+ * deleted once they are written.
+ * deserialize rebuilds an intermediate pair passed to reduce exactly like
+ * emitted pairs are, and deserialize_output rebuilds an output pair in the
+ * process that started the job.
+ */
+class ProcessSerializer
+{
+ public:
+  virtual ~ProcessSerializer () {}
+  virtual void serialize_key (const K2 *key, std::string &out) const = 0;
+  virtual void serialize_value (const V2 *value, std::string &out) const = 0;
+  virtual IntermediatePair deserialize (const char *key, std::size_t key_size,
+                                        const char *value,
+                                        std::size_t value_size) const = 0;
+  virtual void serialize_output (const K3 *key, const V3 *value,
+                                 std::string &out) const = 0;
+  virtual OutputPair deserialize_output (const char *data,
+                                         std::size_t size) const = 0;
+};
+
+/**
+ * optional settings of a job. The defaults behave exactly like a job started
+ * by the four arguments startMapReduceJob.
+ */
+struct JobOptions
+{
+    grouping_t grouping = SORTED_GROUPING;
+    // when set, output pairs are streamed to the sink and outputVec is
+    // left untouched
+    OutputSink *output_sink = nullptr;
+    // when not 0, the pairs of a key with more than this many pairs are cut
+    // into vectors of at most this many pairs, reduced separately and
+    // possibly in parallel. Only for reducers whose outputs for parts of a
+    // key are as good as one output for the whole key, such as associative
+    // reducers whose partial results the client combines afterwards.
+    uint64_t split_reduce_threshold = 0;
+    // when both are set, a SORTED_GROUPING job keeps at most about
+    // spill_pair_budget intermediate pairs per thread in memory. A thread
+    // whose buffer reaches the budget sorts it and writes it as a run file
+    // through the serializer, and reduce then streams a merge of the runs.
+    // The keys of a spilled job reach reduce in ascending order per thread.
+    const PairSerializer *spill_serializer = nullptr;
+    uint64_t spill_pair_budget = 0;
+    // directory the run files are created in, they are unlinked right away
+    const char *spill_directory = "/tmp";
+    // when set, a job of an input vector calls map and reduce in
+    // multiThreadLevel worker processes forked by the job instead of in its
+    // threads, so a client crashing a worker only loses the worker's task.
+    // The task is retried by a new worker, and the job fails once one task
+    // failed max_task_attempts times, see getJobError. The keys of every
+    // partition reach reduce in ascending order. grouping, combining,
+    // spilling and split_reduce_threshold don't apply to such jobs.
+    // Workers are forked only while no other job runs in the process, a
+    // job that has to fork one while another job runs fails instead, and
+    // the client's own threads must not hold locks its workers take.
+    const ProcessSerializer *process_serializer = nullptr;
+    int max_task_attempts = 3;
+};
+
+/**
+ * starts a map reduce job with the given options.
+ * @param client - the map and reduce functions of the job
+ * @param inputVec - input elements
+ * @param outputVec - vector the output elements are added to
+ * @param multiThreadLevel - number of worker threads
+ * @param options - job settings
+ * @return handle of the started job
+ */
+JobHandle startMapReduceJob (const MapReduceClient &client,
+                             const InputVec &inputVec, OutputVec &outputVec,
+                             int multiThreadLevel, const JobOptions &options);
+
+/**
+ * starts a map reduce job whose input pairs are pulled from a source while
+ * the job maps them, instead of read from an input vector built up front.
+ * The source must outlive the job.
+ * @param client - the map and reduce functions of the job
+ * @param source - source of the input pairs
+ * @param outputVec - vector the output elements are added to
+ * @param multiThreadLevel - number of worker threads
+ * @param options - job settings
+ * @return handle of the started job
+ */
+JobHandle startMapReduceJob (const MapReduceClient &client,
+                             InputSource &source, OutputVec &outputVec,
+                             int multiThreadLevel,
+                             const JobOptions &options = JobOptions ());
+
+/**
+ * the phases a job's threads go through. Phases of different threads may
+ * overlap: a thread sorts its pairs while others still map.
+ */
+enum job_phase_t
+{
+    MAP_PHASE = 0,
+    SORT_PHASE = 1,
+    SHUFFLE_PHASE = 2,
+    REDUCE_PHASE = 3,
+    OUTPUT_PHASE = 4,
+    NUM_JOB_PHASES = 5
+};
+
+/**
+ * what one thread of a job did, times in seconds. Of a job running in
+ * worker processes, thread 0's times are those of the thread coordinating
+ * the workers, and the counters of thread i those of worker i
+ */
+struct ThreadStats
+{
+    // time working in every phase, waits at barriers left out. Waiting for
+    // a contended work range lock is part of the work
+    double phase_seconds[NUM_JOB_PHASES];
+    double busy_seconds;
+    double barrier_wait_seconds;
+    double lock_wait_seconds;
+    // the rest of the job's time, such as waiting for a free pool worker or
+    // for other threads after the thread's last phase
+    double idle_seconds;
+    uint64_t items_mapped;
+    uint64_t pairs_emitted;
+    uint64_t pairs_reduced;
+    uint64_t groups_reduced;
+    uint64_t pairs_output;
+};
+
+/**
+ * profile of a finished job, times in seconds
+ */
+struct JobStats
+{
+    double total_seconds;
+    // from the first thread entering a phase to the last one leaving it
+    double phase_seconds[NUM_JOB_PHASES];
+    std::vector<ThreadStats> threads;
+    uint64_t intermediate_pairs;
+    // pairs of the biggest group passed to reduce, a measure of key skew
+    uint64_t largest_group;
+    // bytes of the framework's own pair buffers at their peak, the pairs'
+    // keys and values not included. Buffers are measured when they are
+    // combined, spilled and at the end of map, and the shuffle arena is
+    // added to them since both live at the same time
+    uint64_t peak_intermediate_bytes;
+};
+
+/**
+ * waits for a job to finish and reports where its time went. The profile
+ * is collected by every job, at the cost of a few clock readings per phase
+ * and plain counters per thread.
+ * @param job - handle of the job
+ * @param stats - filled with the job's profile
+ */
+void getJobStats (JobHandle job, JobStats *stats);
+
+/**
+ * tells why a job running in worker processes failed. A failed job stops
+ * making progress and its threads end, so waitForJob returns. Its output
+ * vector is left untouched, though an output sink already got the pairs of
+ * the reduce tasks that finished.
+ * @param job - handle of the job
+ * @return description of the failure, or null while the job didn't fail
+ */
+const char *getJobError (JobHandle job);
+
+#endif //MAPREDUCEFRAMEWORKEXT_H
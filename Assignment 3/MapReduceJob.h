@@ -0,0 +1,408 @@
+#ifndef MAPREDUCEJOB_H
+#define MAPREDUCEJOB_H
+
+#include "Barrier.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+
+#define TYPED_MAP_CHUNK 64
+#define TYPED_SAMPLES_PER_THREAD 64
+#define RADIX_DIGIT_BITS 8
+
+/**
+ * tells whether keys of type K ordered by Compare are sorted by LSD radix
+ * sort, and maps every key to an unsigned integer ordered the same way.
+ * Integral keys under std::less are radix sorted out of the box, other fixed
+ * width keys can specialize it with enabled = true.
+ */
+template <typename K, typename Compare, typename Enable = void>
+struct RadixKey
+{
+    static const bool enabled = false;
+    typedef unsigned int type;
+    static type bits (const K &)
+    {
+      return 0;
+    }
+};
+
+template <typename K>
+struct RadixKey<K, std::less<K>, typename std::enable_if<
+    std::is_integral<K>::value && !std::is_same<K, bool>::value>::type>
+{
+    static const bool enabled = true;
+    typedef typename std::make_unsigned<K>::type type;
+    static type bits (const K &key)
+    {
+      // flipping the sign bit orders negative keys before positive ones
+      type sign = std::is_signed<K>::value
+                  ? (type) ((type) 1 << (sizeof (type) * CHAR_BIT - 1)) : 0;
+      return (type) key ^ sign;
+    }
+};
+
+/**
+ * typed map reduce front end. Keys and values are stored by value in
+ * contiguous per-thread buffers, keys are compared by Compare resolved at
+ * compile time, and keys RadixKey enables are sorted and grouped by LSD
+ * radix sort instead of by comparisons. K and V must be default
+ * constructible and copyable.
+ * A job runs on the shared thread pool: the mapped pairs are cut into one
+ * key range per thread by sampled splitters, every thread gathers and sorts
+ * its range and reduces its groups, each group handed to reduce as one key
+ * and a contiguous array of its values.
+ * The pointer based startMapReduceJob API is unchanged next to it.
+ */
+template <typename K, typename V, typename Compare = std::less<K> >
+class MapReduceJob
+{
+ public:
+  /**
+   * collects the pairs emitted by the map calls of one thread
+   */
+  class Emitter
+  {
+   public:
+    void emit (const K &key, const V &value)
+    {
+      keys.push_back (key);
+      values.push_back (value);
+    }
+
+   private:
+    friend class MapReduceJob;
+    std::vector<K> keys;
+    std::vector<V> values;
+    // bucket_begins[t] is where the pairs of thread t's key range start
+    // once the pairs are partitioned
+    std::vector<std::size_t> bucket_begins;
+  };
+
+  explicit MapReduceJob (int multiThreadLevel, Compare compare = Compare ())
+      : multiThreadLevel (multiThreadLevel), compare (compare)
+  {}
+
+  /**
+   * runs the job and returns once every group was reduced.
+   * @param input - input elements
+   * @param map - called as map (const Input &, Emitter &) for every input
+   * element, emits any number of pairs
+   * @param reduce - called as reduce (const K &key, const V *values,
+   * std::size_t num_values, int worker_id) once for every key, by the
+   * threads in parallel, worker_id being in [0, multiThreadLevel)
+   */
+  template <typename Input, typename Map, typename Reduce>
+  void run (const std::vector<Input> &input, const Map &map,
+            const Reduce &reduce);
+
+ private:
+  template <typename Input, typename Map, typename Reduce>
+  struct Worker
+  {
+      MapReduceJob *job;
+      const std::vector<Input> *input;
+      const Map *map;
+      const Reduce *reduce;
+      int thread_id;
+      Emitter emitter;
+  };
+
+  /**
+   * the work of one thread: map, partition, gather, sort and reduce.
+   * @param worker - the thread's Worker
+   * @return -
+   */
+  template <typename Input, typename Map, typename Reduce>
+  static void *worker_main (void *worker);
+
+  /**
+   * samples the keys all the threads emitted and picks multiThreadLevel - 1
+   * splitters, range t holding the keys below splitters[t] and not below
+   * splitters[t - 1].
+   * @param emitters - emitter of every thread
+   */
+  void choose_splitters (const std::vector<Emitter *> &emitters);
+
+  /**
+   * reorders a thread's pairs by key range, a counting sort on the ranges.
+   * @param emitter - the thread's pairs
+   */
+  void partition (Emitter &emitter);
+
+  /**
+   * sorts keys and values together by key.
+   * @param keys - keys to sort
+   * @param values - values, moved along with their keys
+   */
+  void sort_pairs (std::vector<K> &keys, std::vector<V> &values);
+
+  /**
+   * LSD radix sort of keys and values together, one pass per digit of
+   * RADIX_DIGIT_BITS bits, skipping digits all the keys share.
+   */
+  void radix_sort (std::vector<K> &keys, std::vector<V> &values);
+
+  bool equal_keys (const K &key1, const K &key2) const
+  {
+    if (RadixKey<K, Compare>::enabled)
+    {
+      return RadixKey<K, Compare>::bits (key1)
+             == RadixKey<K, Compare>::bits (key2);
+    }
+    return !compare (key1, key2) && !compare (key2, key1);
+  }
+
+  int multiThreadLevel;
+  Compare compare;
+  std::vector<K> splitters;
+  std::vector<Emitter *> emitters;
+  std::atomic<std::size_t> next_item;
+  Barrier *barrier;
+};
+
+template <typename K, typename V, typename Compare>
+template <typename Input, typename Map, typename Reduce>
+void MapReduceJob<K, V, Compare>::run (const std::vector<Input> &input,
+                                       const Map &map, const Reduce &reduce)
+{
+  typedef Worker<Input, Map, Reduce> worker_t;
+  std::vector<worker_t> workers (multiThreadLevel);
+  std::vector<void *> worker_ptrs (multiThreadLevel);
+  emitters.resize (multiThreadLevel);
+  for (int i = 0; i < multiThreadLevel; ++i)
+  {
+    workers[i].job = this;
+    workers[i].input = &input;
+    workers[i].map = &map;
+    workers[i].reduce = &reduce;
+    workers[i].thread_id = i;
+    emitters[i] = &workers[i].emitter;
+    worker_ptrs[i] = &workers[i];
+  }
+  next_item = 0;
+  Barrier job_barrier (multiThreadLevel);
+  barrier = &job_barrier;
+  ThreadPool &pool = ThreadPool::shared ();
+  pool.waitGang (pool.runGang (multiThreadLevel,
+                               worker_main<Input, Map, Reduce>,
+                               worker_ptrs.data ()));
+  barrier = nullptr;
+  emitters.clear ();
+  splitters.clear ();
+}
+
+template <typename K, typename V, typename Compare>
+template <typename Input, typename Map, typename Reduce>
+void *MapReduceJob<K, V, Compare>::worker_main (void *worker)
+{
+  Worker<Input, Map, Reduce> *cur_worker =
+      (Worker<Input, Map, Reduce> *) worker;
+  MapReduceJob *job = cur_worker->job;
+  const std::vector<Input> &input = *cur_worker->input;
+  int id = cur_worker->thread_id;
+
+  // MAP
+  while (true)
+  {
+    std::size_t first = job->next_item.fetch_add (TYPED_MAP_CHUNK);
+    if (first >= input.size ())
+    {
+      break;
+    }
+    std::size_t last = std::min (input.size (), first + TYPED_MAP_CHUNK);
+    for (std::size_t i = first; i < last; ++i)
+    {
+      (*cur_worker->map) (input[i], cur_worker->emitter);
+    }
+  }
+  job->barrier->barrier ();
+
+  // PARTITION
+  if (id == 0)
+  {
+    job->choose_splitters (job->emitters);
+  }
+  job->barrier->barrier ();
+  job->partition (cur_worker->emitter);
+  job->barrier->barrier ();
+
+  // GATHER & SORT
+  std::vector<K> keys;
+  std::vector<V> values;
+  for (Emitter *emitter: job->emitters)
+  {
+    std::size_t first = emitter->bucket_begins[id];
+    std::size_t last = emitter->bucket_begins[id + 1];
+    keys.insert (keys.end (), emitter->keys.begin () + first,
+                 emitter->keys.begin () + last);
+    values.insert (values.end (), emitter->values.begin () + first,
+                   emitter->values.begin () + last);
+  }
+  job->sort_pairs (keys, values);
+
+  // REDUCE
+  std::size_t group_begin = 0;
+  for (std::size_t i = 1; i <= keys.size (); ++i)
+  {
+    if (i == keys.size () || !job->equal_keys (keys[group_begin], keys[i]))
+    {
+      (*cur_worker->reduce) (keys[group_begin], values.data () + group_begin,
+                             i - group_begin, id);
+      group_begin = i;
+    }
+  }
+  return 0;
+}
+
+template <typename K, typename V, typename Compare>
+void MapReduceJob<K, V, Compare>::choose_splitters (
+    const std::vector<Emitter *> &emitters)
+{
+  std::vector<K> samples;
+  for (Emitter *emitter: emitters)
+  {
+    std::size_t num_keys = emitter->keys.size ();
+    std::size_t step = num_keys / TYPED_SAMPLES_PER_THREAD;
+    if (step == 0)
+    {
+      step = 1;
+    }
+    for (std::size_t i = step / 2; i < num_keys; i += step)
+    {
+      samples.push_back (emitter->keys[i]);
+    }
+  }
+  std::sort (samples.begin (), samples.end (), compare);
+  splitters.clear ();
+  if (samples.empty ())
+  {
+    return;
+  }
+  for (int i = 1; i < multiThreadLevel; ++i)
+  {
+    splitters.push_back (samples[(i * samples.size ()) / multiThreadLevel]);
+  }
+}
+
+template <typename K, typename V, typename Compare>
+void MapReduceJob<K, V, Compare>::partition (Emitter &emitter)
+{
+  std::size_t num_pairs = emitter.keys.size ();
+  std::vector<int> buckets (num_pairs);
+  std::vector<std::size_t> &begins = emitter.bucket_begins;
+  begins.assign (multiThreadLevel + 1, 0);
+  for (std::size_t i = 0; i < num_pairs; ++i)
+  {
+    buckets[i] = (int) (std::upper_bound (splitters.begin (),
+                                          splitters.end (),
+                                          emitter.keys[i], compare)
+                        - splitters.begin ());
+    begins[buckets[i] + 1]++;
+  }
+  for (int t = 0; t < multiThreadLevel; ++t)
+  {
+    begins[t + 1] += begins[t];
+  }
+
+  std::vector<std::size_t> next (begins.begin (), begins.end () - 1);
+  std::vector<K> keys (num_pairs);
+  std::vector<V> values (num_pairs);
+  for (std::size_t i = 0; i < num_pairs; ++i)
+  {
+    std::size_t position = next[buckets[i]]++;
+    keys[position] = std::move (emitter.keys[i]);
+    values[position] = std::move (emitter.values[i]);
+  }
+  emitter.keys.swap (keys);
+  emitter.values.swap (values);
+}
+
+template <typename K, typename V, typename Compare>
+void MapReduceJob<K, V, Compare>::sort_pairs (std::vector<K> &keys,
+                                              std::vector<V> &values)
+{
+  if (RadixKey<K, Compare>::enabled)
+  {
+    radix_sort (keys, values);
+    return;
+  }
+  // sorting an index keeps every key next to its value, then both are
+  // gathered once
+  std::size_t num_pairs = keys.size ();
+  std::vector<std::size_t> order (num_pairs);
+  for (std::size_t i = 0; i < num_pairs; ++i)
+  {
+    order[i] = i;
+  }
+  const Compare &key_compare = compare;
+  std::sort (order.begin (), order.end (),
+             [&keys, &key_compare] (std::size_t i, std::size_t j)
+             { return key_compare (keys[i], keys[j]); });
+  std::vector<K> sorted_keys (num_pairs);
+  std::vector<V> sorted_values (num_pairs);
+  for (std::size_t i = 0; i < num_pairs; ++i)
+  {
+    sorted_keys[i] = std::move (keys[order[i]]);
+    sorted_values[i] = std::move (values[order[i]]);
+  }
+  keys.swap (sorted_keys);
+  values.swap (sorted_values);
+}
+
+template <typename K, typename V, typename Compare>
+void MapReduceJob<K, V, Compare>::radix_sort (std::vector<K> &keys,
+                                              std::vector<V> &values)
+{
+  typedef RadixKey<K, Compare> radix_key;
+  const unsigned int num_digits = 1 << RADIX_DIGIT_BITS;
+  const unsigned int digit_mask = num_digits - 1;
+  std::size_t num_pairs = keys.size ();
+  if (num_pairs < 2)
+  {
+    return;
+  }
+  std::vector<K> key_scratch (num_pairs);
+  std::vector<V> value_scratch (num_pairs);
+  for (unsigned int shift = 0;
+       shift < sizeof (typename radix_key::type) * CHAR_BIT;
+       shift += RADIX_DIGIT_BITS)
+  {
+    std::size_t counts[num_digits] = {0};
+    for (const K &key: keys)
+    {
+      counts[(radix_key::bits (key) >> shift) & digit_mask]++;
+    }
+    // a digit all the keys share doesn't reorder anything
+    if (counts[(radix_key::bits (keys[0]) >> shift) & digit_mask]
+        == num_pairs)
+    {
+      continue;
+    }
+    std::size_t offset = 0;
+    for (unsigned int digit = 0; digit < num_digits; ++digit)
+    {
+      std::size_t count = counts[digit];
+      counts[digit] = offset;
+      offset += count;
+    }
+    for (std::size_t i = 0; i < num_pairs; ++i)
+    {
+      std::size_t position =
+          counts[(radix_key::bits (keys[i]) >> shift) & digit_mask]++;
+      key_scratch[position] = std::move (keys[i]);
+      value_scratch[position] = std::move (values[i]);
+    }
+    keys.swap (key_scratch);
+    values.swap (value_scratch);
+  }
+}
+
+#endif //MAPREDUCEJOB_H
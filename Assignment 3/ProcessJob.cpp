@@ -0,0 +1,833 @@
+#include "ProcessJob.h"
+#include "JobContext.h"
+#include "SystemError.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#define MAP_TASKS_PER_WORKER 8
+// larger payloads are taken for a broken peer rather than allocated
+#define MAX_MESSAGE_BYTES ((uint64_t) 1 << 40)
+#define MESSAGE_CHUNK_BYTES (1 << 20)
+
+// internal structs defined below, used by the prototypes
+typedef struct ProcessMessage ProcessMessage;
+typedef struct ProcessTask ProcessTask;
+typedef struct WorkerProcess WorkerProcess;
+typedef struct Coordinator Coordinator;
+
+/**
+ * how receiving a message from a socket ended
+ */
+enum receive_t
+{
+    MESSAGE_RECEIVED = 0,
+    // the peer closed the socket
+    PEER_GONE = 1,
+    // the header is not one the peer could have sent
+    MESSAGE_MALFORMED = 2
+};
+
+/**
+ * adds a task to the ones ready to run.
+ * @param coordinator - coordinator of the job
+ * @param is_map - whether the task maps or reduces
+ * @param first - first input item of a map task, partition of a reduce task
+ * @param last - end of the input items of a map task
+ */
+void add_task (Coordinator &coordinator, bool is_map, uint64_t first,
+               uint64_t last);
+
+/**
+ * runs the tasks added to the coordinator until they are all done or the
+ * job failed.
+ * @param coordinator - coordinator of the job
+ */
+void run_tasks (Coordinator &coordinator);
+
+/**
+ * hands ready tasks to the idle workers.
+ * @param coordinator - coordinator of the job
+ */
+void assign_tasks (Coordinator &coordinator);
+
+/**
+ * applies a message of a worker to the job.
+ * @param coordinator - coordinator of the job
+ * @param slot - index of the worker
+ * @param message - header of the message
+ * @param payload - bytes of the message
+ */
+void handle_message (Coordinator &coordinator, int slot,
+                     const ProcessMessage &message, std::string &payload);
+
+/**
+ * replaces a worker that failed, retrying its task, or fails the job once
+ * the task failed max_task_attempts times.
+ * @param coordinator - coordinator of the job
+ * @param slot - index of the worker
+ * @param reason - how the worker broke the protocol, in which case it is
+ * killed, or null when its socket closed
+ */
+void worker_failed (Coordinator &coordinator, int slot, const char *reason);
+
+/**
+ * forks a worker process into a slot of the coordinator, or fails the job
+ * when the threads of other jobs are running.
+ * @param coordinator - coordinator of the job
+ * @param slot - index of the worker
+ */
+void start_worker (Coordinator &coordinator, int slot);
+
+/**
+ * tells all the workers to exit, or kills them when the job failed, and
+ * waits for them.
+ * @param coordinator - coordinator of the job
+ */
+void stop_workers (Coordinator &coordinator);
+
+/**
+ * runs the tasks the coordinator sends until it tells the worker to exit.
+ * @param context - context of the worker, the one with its index
+ * @param fd - the worker's end of its socket
+ */
+void worker_loop (void *context, int fd);
+
+/**
+ * maps the input items of a map task and sends their pairs partition by
+ * partition.
+ * @param context - context of the worker
+ * @param fd - the worker's end of its socket
+ * @param message - header of the task
+ * @return false once the coordinator is gone
+ */
+bool run_map_task (void *context, int fd, const ProcessMessage &message);
+
+/**
+ * reduces the pairs of a partition in key order and sends the output.
+ * @param context - context of the worker
+ * @param fd - the worker's end of its socket
+ * @param message - header of the task
+ * @param payload - the partition's pairs, freed once they are read
+ * @return false once the coordinator is gone
+ */
+bool run_reduce_task (void *context, int fd, const ProcessMessage &message,
+                      std::string &payload);
+
+/**
+ * sends a message over a socket.
+ * @param fd - the socket
+ * @param type - message_t of the message
+ * @param task - task the message is about
+ * @param arg1 - first argument, depending on the type
+ * @param arg2 - second argument, depending on the type
+ * @param payload - bytes following the header
+ * @return false when the peer is gone
+ */
+bool send_message (int fd, uint32_t type, uint32_t task, uint64_t arg1,
+                   uint64_t arg2, const std::string &payload);
+
+/**
+ * receives a message from a socket. The payload grows as its bytes arrive,
+ * so a size the peer never sends is never allocated.
+ * @param fd - the socket
+ * @param message - set to the header of the message
+ * @param payload - set to the bytes following the header
+ * @return how receiving ended, MESSAGE_MALFORMED when the payload would be
+ * larger than MAX_MESSAGE_BYTES
+ */
+receive_t
+receive_message (int fd, ProcessMessage &message, std::string &payload);
+
+/**
+ * reads exactly size bytes from a socket.
+ * @param fd - the socket
+ * @param data - where the bytes are written
+ * @param size - number of bytes to read
+ * @return false when the peer closed it first
+ */
+bool receive_all (int fd, char *data, uint64_t size);
+
+/////////// structs ///////////
+
+/**
+ * kinds of the messages between the coordinator of a process job and its
+ * workers
+ */
+enum message_t
+{
+    // input items [arg1, arg2)
+    MAP_TASK_MESSAGE = 0,
+    // arg1 pairs of partition arg2 as payload
+    REDUCE_TASK_MESSAGE = 1,
+    EXIT_MESSAGE = 2,
+    // arg1 pairs of partition arg2 of a running map task as payload
+    PARTITION_MESSAGE = 3,
+    // arg1 input items mapped into arg2 pairs
+    MAP_DONE_MESSAGE = 4,
+    // arg1 output pairs as payload, the largest group having arg2 pairs
+    REDUCE_DONE_MESSAGE = 5
+};
+
+/**
+ * header of a message, followed by size bytes of payload. Pairs in a
+ * payload are records of their sizes and then their bytes.
+ */
+struct ProcessMessage
+{
+    uint32_t type;
+    uint32_t task;
+    uint64_t arg1;
+    uint64_t arg2;
+    uint64_t size;
+};
+
+/**
+ * a map task of the input items [first, last), or a reduce task of
+ * partition first
+ */
+struct ProcessTask
+{
+    bool is_map;
+    uint64_t first;
+    uint64_t last;
+    int attempts;
+};
+
+struct WorkerProcess
+{
+    pid_t pid = -1;
+    int fd = -1;
+    // the task the worker runs, -1 while it is idle
+    int task = -1;
+    // partitions the worker sent for its running map task, added to the
+    // job's partitions once the task is done
+    std::vector<std::string> partitions;
+    std::vector<uint64_t> partition_pairs;
+};
+
+struct Coordinator
+{
+    Job *job;
+    std::vector<WorkerProcess> workers;
+    std::vector<ProcessTask> tasks;
+    std::deque<int> ready_tasks;
+    // tasks added and not done yet
+    uint64_t tasks_left = 0;
+    std::vector<std::string> partitions;
+    std::vector<uint64_t> partition_pairs;
+    uint64_t partition_bytes = 0;
+    // output of the reduce tasks, added to the output vector once the job
+    // is done
+    OutputVec output;
+    bool failed = false;
+};
+
+// held while a worker is forked, so a worker of one job never inherits the
+// worker's end of a socket of another job, whose coordinator would then
+// miss that its worker died
+static pthread_mutex_t fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+// threads running the work of a job, guarded by fork_mutex. A worker is
+// forked only while its coordinator is the single one, since the child gets
+// a copy of every lock the other threads hold, in the framework, in malloc
+// or in the client, and no thread to ever release it
+static int running_job_threads = 0;
+
+/////////// FUNCTIONS ///////////
+
+void enter_job_thread ()
+{
+  int lock_success = pthread_mutex_lock (&fork_mutex);
+  check_system_error (lock_success);
+  running_job_threads++;
+  int unlock_success = pthread_mutex_unlock (&fork_mutex);
+  check_system_error (unlock_success);
+}
+
+void leave_job_thread ()
+{
+  int lock_success = pthread_mutex_lock (&fork_mutex);
+  check_system_error (lock_success);
+  running_job_threads--;
+  int unlock_success = pthread_mutex_unlock (&fork_mutex);
+  check_system_error (unlock_success);
+}
+
+void *run_process_job (void *context)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  enter_job_thread ();
+  cur_context->thread_begin = now_seconds () - job->start_time;
+  Coordinator coordinator;
+  coordinator.job = job;
+  coordinator.workers.resize (job->multiThreadLevel);
+  coordinator.partitions.resize (job->num_partitions);
+  coordinator.partition_pairs.assign (job->num_partitions, 0);
+  for (int i = 0; i < job->multiThreadLevel && !coordinator.failed; ++i)
+  {
+    start_worker (coordinator, i);
+  }
+
+  // MAP
+  enter_phase (context, MAP_PHASE);
+  uint64_t num_tasks = (uint64_t) job->multiThreadLevel * MAP_TASKS_PER_WORKER;
+  for (uint64_t t = 0; t < num_tasks; ++t)
+  {
+    uint64_t first = (job->input_vec_size * t) / num_tasks;
+    uint64_t last = (job->input_vec_size * (t + 1)) / num_tasks;
+    if (last > first)
+    {
+      add_task (coordinator, true, first, last);
+    }
+  }
+  run_tasks (coordinator);
+
+  if (!coordinator.failed)
+  {
+    // SHUFFLE, the workers already partitioned their pairs
+    enter_phase (context, SHUFFLE_PHASE);
+    update_atomic_counter (job, SHUFFLE_STAGE, *job->ac_num_inter_pairs);
+    update_atomic_counter (job, REDUCE_STAGE, 0);
+
+    // REDUCE
+    enter_phase (context, REDUCE_PHASE);
+    for (int p = 0; p < job->num_partitions; ++p)
+    {
+      if (coordinator.partition_pairs[p] > 0)
+      {
+        add_task (coordinator, false, p, p + 1);
+      }
+    }
+    run_tasks (coordinator);
+  }
+
+  // OUTPUT
+  enter_phase (context, OUTPUT_PHASE);
+  stop_workers (coordinator);
+  if (!coordinator.failed)
+  {
+    job->outputVec->insert (job->outputVec->end (),
+                            coordinator.output.begin (),
+                            coordinator.output.end ());
+  }
+  else
+  {
+    for (const OutputPair &pair: coordinator.output)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+  enter_phase (context, NUM_JOB_PHASES);
+  cur_context->thread_end = now_seconds () - job->start_time;
+  leave_job_thread ();
+  return 0;
+}
+
+void add_task (Coordinator &coordinator, bool is_map, uint64_t first,
+               uint64_t last)
+{
+  ProcessTask task = {is_map, first, last, 0};
+  coordinator.tasks.push_back (task);
+  coordinator.ready_tasks.push_back (
+      (int) coordinator.tasks.size () - 1);
+  coordinator.tasks_left++;
+}
+
+void run_tasks (Coordinator &coordinator)
+{
+  std::vector<struct pollfd> fds (coordinator.workers.size ());
+  while (coordinator.tasks_left > 0 && !coordinator.failed)
+  {
+    assign_tasks (coordinator);
+    for (std::size_t i = 0; i < fds.size (); ++i)
+    {
+      fds[i].fd = coordinator.workers[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    int num_ready = poll (fds.data (), fds.size (), -1);
+    if (num_ready < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    check_system_error (num_ready < 0);
+    for (std::size_t i = 0; i < fds.size () && !coordinator.failed; ++i)
+    {
+      if (fds[i].revents == 0)
+      {
+        continue;
+      }
+      ProcessMessage message;
+      std::string payload;
+      receive_t received = receive_message (fds[i].fd, message, payload);
+      if (received == MESSAGE_RECEIVED)
+      {
+        handle_message (coordinator, (int) i, message, payload);
+      }
+      else
+      {
+        worker_failed (coordinator, (int) i,
+                       received == MESSAGE_MALFORMED
+                       ? "sent a malformed message" : nullptr);
+      }
+    }
+  }
+}
+
+void assign_tasks (Coordinator &coordinator)
+{
+  for (std::size_t i = 0; i < coordinator.workers.size ()
+                          && !coordinator.failed; ++i)
+  {
+    WorkerProcess &worker = coordinator.workers[i];
+    if (worker.task >= 0 || coordinator.ready_tasks.empty ())
+    {
+      continue;
+    }
+    worker.task = coordinator.ready_tasks.front ();
+    coordinator.ready_tasks.pop_front ();
+    const ProcessTask &task = coordinator.tasks[worker.task];
+    bool sent;
+    if (task.is_map)
+    {
+      sent = send_message (worker.fd, MAP_TASK_MESSAGE, worker.task,
+                           task.first, task.last, std::string ());
+    }
+    else
+    {
+      sent = send_message (worker.fd, REDUCE_TASK_MESSAGE, worker.task,
+                           coordinator.partition_pairs[task.first],
+                           task.first,
+                           coordinator.partitions[task.first]);
+    }
+    if (!sent)
+    {
+      worker_failed (coordinator, (int) i, nullptr);
+    }
+  }
+}
+
+void handle_message (Coordinator &coordinator, int slot,
+                     const ProcessMessage &message, std::string &payload)
+{
+  Job *job = coordinator.job;
+  WorkerProcess &worker = coordinator.workers[slot];
+  ThreadContext &worker_context = job->thread_contexts[slot];
+  if (worker.task < 0 || message.task != (uint32_t) worker.task)
+  {
+    worker_failed (coordinator, slot, "sent a message of another task");
+    return;
+  }
+  const ProcessTask &task = coordinator.tasks[worker.task];
+  if (message.type == PARTITION_MESSAGE && task.is_map
+      && message.arg2 < (uint64_t) job->num_partitions)
+  {
+    worker.partitions.resize (job->num_partitions);
+    worker.partition_pairs.resize (job->num_partitions, 0);
+    worker.partitions[message.arg2].swap (payload);
+    worker.partition_pairs[message.arg2] = message.arg1;
+    return;
+  }
+  if (message.type == MAP_DONE_MESSAGE && task.is_map)
+  {
+    for (std::size_t p = 0; p < worker.partitions.size (); ++p)
+    {
+      coordinator.partitions[p] += worker.partitions[p];
+      coordinator.partition_pairs[p] += worker.partition_pairs[p];
+      coordinator.partition_bytes += worker.partitions[p].size ();
+    }
+    std::vector<std::string> ().swap (worker.partitions);
+    std::vector<uint64_t> ().swap (worker.partition_pairs);
+    *job->ac_num_inter_pairs += message.arg2;
+    job->stage_counters[MAP_STAGE] += message.arg1;
+    worker_context.stats.items_mapped += message.arg1;
+    worker_context.stats.pairs_emitted += message.arg2;
+    job->thread_contexts[0].peak_buffer_bytes =
+        std::max (job->thread_contexts[0].peak_buffer_bytes,
+                  coordinator.partition_bytes);
+  }
+  else if (message.type == REDUCE_DONE_MESSAGE && !task.is_map)
+  {
+    const ProcessSerializer *serializer = job->options.process_serializer;
+    OutputSink *sink = job->options.output_sink;
+    // the records are checked before any is consumed, a task retried after
+    // a malformed message does not output its pairs twice
+    uint64_t offset = 0;
+    while (offset < payload.size ())
+    {
+      uint32_t record_size;
+      if (payload.size () - offset < sizeof (record_size))
+      {
+        worker_failed (coordinator, slot, "sent a malformed message");
+        return;
+      }
+      memcpy (&record_size, payload.data () + offset, sizeof (record_size));
+      offset += sizeof (record_size);
+      if (record_size > payload.size () - offset)
+      {
+        worker_failed (coordinator, slot, "sent a malformed message");
+        return;
+      }
+      offset += record_size;
+    }
+    offset = 0;
+    while (offset < payload.size ())
+    {
+      uint32_t record_size;
+      memcpy (&record_size, payload.data () + offset, sizeof (record_size));
+      offset += sizeof (record_size);
+      OutputPair pair = serializer->deserialize_output (
+          payload.data () + offset, record_size);
+      offset += record_size;
+      if (sink != nullptr)
+      {
+        sink->consume (slot, pair.first, pair.second);
+      }
+      else
+      {
+        coordinator.output.push_back (pair);
+      }
+    }
+    uint64_t num_pairs = coordinator.partition_pairs[task.first];
+    job->stage_counters[REDUCE_STAGE] += num_pairs;
+    worker_context.stats.pairs_reduced += num_pairs;
+    worker_context.stats.pairs_output += message.arg1;
+    worker_context.largest_group =
+        std::max (worker_context.largest_group, message.arg2);
+    coordinator.partition_bytes -=
+        coordinator.partitions[task.first].size ();
+    std::string ().swap (coordinator.partitions[task.first]);
+  }
+  else
+  {
+    worker_failed (coordinator, slot, "sent a message out of order");
+    return;
+  }
+  worker.task = -1;
+  coordinator.tasks_left--;
+}
+
+void worker_failed (Coordinator &coordinator, int slot, const char *reason)
+{
+  Job *job = coordinator.job;
+  WorkerProcess &worker = coordinator.workers[slot];
+  if (reason != nullptr)
+  {
+    kill (worker.pid, SIGKILL);
+  }
+  int status = 0;
+  check_system_error (waitpid (worker.pid, &status, 0) < 0);
+  close (worker.fd);
+  worker.fd = -1;
+  std::vector<std::string> ().swap (worker.partitions);
+  std::vector<uint64_t> ().swap (worker.partition_pairs);
+  int task_id = worker.task;
+  worker.task = -1;
+  if (task_id >= 0)
+  {
+    ProcessTask &task = coordinator.tasks[task_id];
+    if (++task.attempts >= job->options.max_task_attempts)
+    {
+      std::string how = reason != nullptr ? reason
+                        : WIFSIGNALED (status)
+                          ? "was killed by signal "
+                            + std::to_string (WTERMSIG (status))
+                          : "exited with status "
+                            + std::to_string (WEXITSTATUS (status));
+      job->error = std::string (task.is_map ? "map" : "reduce") + " task "
+                   + std::to_string (task_id) + " failed "
+                   + std::to_string (task.attempts)
+                   + " times, its last worker " + how;
+      *job->failed = true;
+      coordinator.failed = true;
+      return;
+    }
+    // the retry runs before the tasks that never ran
+    coordinator.ready_tasks.push_front (task_id);
+  }
+  start_worker (coordinator, slot);
+}
+
+void start_worker (Coordinator &coordinator, int slot)
+{
+  int lock_success = pthread_mutex_lock (&fork_mutex);
+  check_system_error (lock_success);
+  if (running_job_threads > 1)
+  {
+    int unlock_success = pthread_mutex_unlock (&fork_mutex);
+    check_system_error (unlock_success);
+    Job *job = coordinator.job;
+    job->error = "can't fork a worker while another job runs";
+    *job->failed = true;
+    coordinator.failed = true;
+    return;
+  }
+  int fds[2];
+  check_system_error (socketpair (AF_UNIX, SOCK_STREAM, 0, fds));
+  pid_t pid = fork ();
+  check_system_error (pid < 0);
+  if (pid == 0)
+  {
+    // the worker keeps only its own end of its own socket
+    close (fds[0]);
+    for (const WorkerProcess &worker: coordinator.workers)
+    {
+      if (worker.fd >= 0)
+      {
+        close (worker.fd);
+      }
+    }
+    worker_loop (coordinator.job->thread_contexts + slot, fds[1]);
+    // skips the exit handlers of the process the worker was forked from
+    _exit (0);
+  }
+  close (fds[1]);
+  int unlock_success = pthread_mutex_unlock (&fork_mutex);
+  check_system_error (unlock_success);
+  coordinator.workers[slot].pid = pid;
+  coordinator.workers[slot].fd = fds[0];
+}
+
+void stop_workers (Coordinator &coordinator)
+{
+  for (WorkerProcess &worker: coordinator.workers)
+  {
+    if (worker.fd < 0)
+    {
+      continue;
+    }
+    // a worker of a failed job may still run a task
+    if (coordinator.failed)
+    {
+      kill (worker.pid, SIGKILL);
+    }
+    else
+    {
+      send_message (worker.fd, EXIT_MESSAGE, 0, 0, 0, std::string ());
+    }
+    close (worker.fd);
+    worker.fd = -1;
+    check_system_error (waitpid (worker.pid, nullptr, 0) < 0);
+  }
+}
+
+void worker_loop (void *context, int fd)
+{
+  ProcessMessage message;
+  std::string payload;
+  bool connected = true;
+  while (connected
+         && receive_message (fd, message, payload) == MESSAGE_RECEIVED)
+  {
+    if (message.type == MAP_TASK_MESSAGE)
+    {
+      connected = run_map_task (context, fd, message);
+    }
+    else if (message.type == REDUCE_TASK_MESSAGE)
+    {
+      connected = run_reduce_task (context, fd, message, payload);
+    }
+    else
+    {
+      connected = false;
+    }
+  }
+  close (fd);
+}
+
+bool run_map_task (void *context, int fd, const ProcessMessage &message)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  cur_context->process_partitions.assign (job->num_partitions,
+                                          std::string ());
+  cur_context->process_pairs.assign (job->num_partitions, 0);
+  for (uint64_t i = message.arg1; i < message.arg2; ++i)
+  {
+    const InputPair &cur_pair = (*(job->inputVec))[i];
+    job->client->map (cur_pair.first, cur_pair.second, context);
+  }
+  uint64_t num_pairs = 0;
+  for (int p = 0; p < job->num_partitions; ++p)
+  {
+    uint64_t partition_pairs = cur_context->process_pairs[p];
+    if (partition_pairs > 0
+        && !send_message (fd, PARTITION_MESSAGE, message.task, partition_pairs,
+                          p, cur_context->process_partitions[p]))
+    {
+      return false;
+    }
+    num_pairs += partition_pairs;
+  }
+  std::vector<std::string> ().swap (cur_context->process_partitions);
+  return send_message (fd, MAP_DONE_MESSAGE, message.task,
+                       message.arg2 - message.arg1, num_pairs, std::string ());
+}
+
+bool run_reduce_task (void *context, int fd, const ProcessMessage &message,
+                      std::string &payload)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  const ProcessSerializer *serializer =
+      cur_context->job->options.process_serializer;
+  IntermediateVec pairs;
+  pairs.reserve (message.arg1);
+  uint64_t offset = 0;
+  while (offset + 2 * sizeof (uint32_t) <= payload.size ())
+  {
+    uint32_t sizes[2];
+    memcpy (sizes, payload.data () + offset, sizeof (sizes));
+    offset += sizeof (sizes);
+    const char *key = payload.data () + offset;
+    pairs.push_back (serializer->deserialize (key, sizes[0], key + sizes[0],
+                                              sizes[1]));
+    offset += sizes[0] + sizes[1];
+  }
+  std::string ().swap (payload);
+
+  std::sort (pairs.begin (), pairs.end (), pair_sort_inter);
+  cur_context->process_output.clear ();
+  cur_context->process_output_pairs = 0;
+  cur_context->largest_group = 0;
+  uint64_t group_begin = 0;
+  for (uint64_t i = 1; i <= pairs.size (); ++i)
+  {
+    // reduce may delete the group's keys, the next group's aren't touched
+    if (i == pairs.size () || *pairs[group_begin].first < *pairs[i].first)
+    {
+      reduce_pairs (context, pairs.data () + group_begin, i - group_begin);
+      group_begin = i;
+    }
+  }
+  bool sent = send_message (fd, REDUCE_DONE_MESSAGE, message.task,
+                            cur_context->process_output_pairs,
+                            cur_context->largest_group,
+                            cur_context->process_output);
+  std::string ().swap (cur_context->process_output);
+  return sent;
+}
+
+void process_emit2 (void *context, K2 *key, V2 *value)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  Job *job = cur_context->job;
+  const ProcessSerializer *serializer = job->options.process_serializer;
+  std::string &key_bytes = cur_context->process_key;
+  key_bytes.clear ();
+  serializer->serialize_key (key, key_bytes);
+  std::size_t p = std::hash<std::string> () (key_bytes) % job->num_partitions;
+
+  // the record's value size is known once the value is written after it
+  std::string &partition = cur_context->process_partitions[p];
+  uint32_t sizes[2] = {(uint32_t) key_bytes.size (), 0};
+  std::size_t record_begin = partition.size ();
+  partition.append ((const char *) sizes, sizeof (sizes));
+  partition += key_bytes;
+  std::size_t value_begin = partition.size ();
+  serializer->serialize_value (value, partition);
+  sizes[1] = (uint32_t) (partition.size () - value_begin);
+  memcpy (&partition[record_begin], sizes, sizeof (sizes));
+  cur_context->process_pairs[p]++;
+  delete key;
+  delete value;
+}
+
+void process_emit3 (void *context, K3 *key, V3 *value)
+{
+  ThreadContext *cur_context = (ThreadContext *) context;
+  std::string &output = cur_context->process_output;
+  uint32_t record_size = 0;
+  std::size_t record_begin = output.size ();
+  output.append ((const char *) &record_size, sizeof (record_size));
+  cur_context->job->options.process_serializer->serialize_output (key, value,
+                                                                  output);
+  record_size = (uint32_t) (output.size () - record_begin
+                            - sizeof (record_size));
+  memcpy (&output[record_begin], &record_size, sizeof (record_size));
+  cur_context->process_output_pairs++;
+  delete key;
+  delete value;
+}
+
+bool send_message (int fd, uint32_t type, uint32_t task, uint64_t arg1,
+                   uint64_t arg2, const std::string &payload)
+{
+  ProcessMessage message = {type, task, arg1, arg2, payload.size ()};
+  const char *parts[2] = {(const char *) &message, payload.data ()};
+  uint64_t sizes[2] = {sizeof (message), payload.size ()};
+  for (int i = 0; i < 2; ++i)
+  {
+    uint64_t sent = 0;
+    while (sent < sizes[i])
+    {
+      // a peer that is gone fails the send instead of raising SIGPIPE
+      ssize_t result = send (fd, parts[i] + sent, sizes[i] - sent,
+                             MSG_NOSIGNAL);
+      if (result < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (result <= 0)
+      {
+        return false;
+      }
+      sent += result;
+    }
+  }
+  return true;
+}
+
+receive_t
+receive_message (int fd, ProcessMessage &message, std::string &payload)
+{
+  if (!receive_all (fd, (char *) &message, sizeof (message)))
+  {
+    return PEER_GONE;
+  }
+  if (message.size > MAX_MESSAGE_BYTES)
+  {
+    return MESSAGE_MALFORMED;
+  }
+  payload.clear ();
+  while (payload.size () < message.size)
+  {
+    uint64_t received = payload.size ();
+    uint64_t chunk = std::min (message.size - received,
+                               (uint64_t) MESSAGE_CHUNK_BYTES);
+    payload.resize (received + chunk);
+    if (!receive_all (fd, &payload[received], chunk))
+    {
+      return PEER_GONE;
+    }
+  }
+  return MESSAGE_RECEIVED;
+}
+
+bool receive_all (int fd, char *data, uint64_t size)
+{
+  uint64_t received = 0;
+  while (received < size)
+  {
+    ssize_t result = recv (fd, data + received, size - received, 0);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0)
+    {
+      return false;
+    }
+    received += result;
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef PROCESSJOB_H
+#define PROCESSJOB_H
+
+#include "MapReduceClient.h"
+
+// a job whose map and reduce run in forked worker processes, coordinated by
+// the single thread of its gang and exchanging the pairs serialized over
+// sockets
+
+/**
+ * counts the calling thread as one running the work of a job until it calls
+ * leave_job_thread. Worker processes are only forked while no other job
+ * thread runs.
+ */
+void enter_job_thread ();
+
+/**
+ * stops counting the calling thread as one running the work of a job.
+ */
+void leave_job_thread ();
+
+/**
+ * coordinates a job running in worker processes: forks the workers, hands
+ * them the map tasks and then the reduce tasks, and collects their results.
+ * @param context - context of thread 0, the only thread of such a job
+ * @return -
+ */
+void *run_process_job (void *context);
+
+/**
+ * emit2 of a worker process, serializes the pair into its partition.
+ * @param context - context of the worker
+ * @param key - key of the pair
+ * @param value - value of the pair
+ */
+void process_emit2 (void *context, K2 *key, V2 *value);
+
+/**
+ * emit3 of a worker process, serializes the pair into the task's output.
+ * @param context - context of the worker
+ * @param key - key of the pair
+ * @param value - value of the pair
+ */
+void process_emit3 (void *context, K3 *key, V3 *value);
+
+#endif //PROCESSJOB_H
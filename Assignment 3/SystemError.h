@@ -0,0 +1,12 @@
+#ifndef SYSTEMERROR_H
+#define SYSTEMERROR_H
+
+/**
+ * prints the system error message and exits when indicator is set, defined
+ * by the framework and shared by its sources and the templates of its
+ * headers.
+ * @param indicator - non zero when a call failed
+ */
+void check_system_error (int indicator);
+
+#endif //SYSTEMERROR_H
@@ -0,0 +1,152 @@
+#include "ThreadPool.h"
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+
+struct Gang {
+	gang_task_t task;
+	std::vector<void *> args;
+	// tasks that didn't return yet
+	int running;
+};
+
+static void check_pool_error(int status, const char *call)
+{
+	if (status != 0) {
+		fprintf(stderr, "[[ThreadPool]] error on %s", call);
+		exit(1);
+	}
+}
+
+ThreadPool &ThreadPool::shared()
+{
+	// never destroyed, the workers may still run a job while the process
+	// exits
+	static ThreadPool *pool = new ThreadPool(sysconf(_SC_NPROCESSORS_ONLN));
+	return *pool;
+}
+
+ThreadPool::ThreadPool(int numWorkers)
+		: idleWorkers(0)
+		, shuttingDown(false)
+{
+	check_pool_error(pthread_mutex_init(&mutex, NULL),
+	                 "pthread_mutex_init");
+	check_pool_error(pthread_cond_init(&readyCond, NULL), "pthread_cond_init");
+	check_pool_error(pthread_cond_init(&doneCond, NULL), "pthread_cond_init");
+	check_pool_error(pthread_mutex_lock(&mutex), "pthread_mutex_lock");
+	addWorkers(numWorkers > 0 ? numWorkers : 1);
+	check_pool_error(pthread_mutex_unlock(&mutex), "pthread_mutex_unlock");
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	check_pool_error(pthread_mutex_lock(&mutex), "pthread_mutex_lock");
+	shuttingDown = true;
+	check_pool_error(pthread_cond_broadcast(&readyCond),
+	                 "pthread_cond_broadcast");
+	check_pool_error(pthread_mutex_unlock(&mutex), "pthread_mutex_unlock");
+	for (pthread_t worker : workers) {
+		check_pool_error(pthread_join(worker, NULL), "pthread_join");
+	}
+	pthread_cond_destroy(&readyCond);
+	pthread_cond_destroy(&doneCond);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+void ThreadPool::addWorkers(int count)
+{
+	for (int i = 0; i < count; ++i) {
+		pthread_t worker;
+		check_pool_error(pthread_create(&worker, NULL, workerLoop, this),
+		                 "pthread_create");
+		workers.push_back(worker);
+		idleWorkers++;
+	}
+}
+
+
+void ThreadPool::startGangs()
+{
+	// only the oldest gang may start, so a gang waiting for many workers
+	// isn't starved by smaller ones submitted after it
+	while (!waitingGangs.empty() &&
+	       (int) waitingGangs.front()->args.size() <= idleWorkers) {
+		Gang *gang = waitingGangs.front();
+		waitingGangs.pop_front();
+		int numTasks = (int) gang->args.size();
+		for (int i = 0; i < numTasks; ++i) {
+			readyTasks.push_back(std::make_pair(gang, i));
+		}
+		idleWorkers -= numTasks;
+		check_pool_error(pthread_cond_broadcast(&readyCond),
+		                 "pthread_cond_broadcast");
+	}
+}
+
+
+Gang *ThreadPool::runGang(int numTasks, gang_task_t task, void **args)
+{
+	Gang *gang = new Gang;
+	gang->task = task;
+	gang->args.assign(args, args + numTasks);
+	gang->running = numTasks;
+
+	check_pool_error(pthread_mutex_lock(&mutex), "pthread_mutex_lock");
+	if (numTasks > (int) workers.size()) {
+		addWorkers(numTasks - (int) workers.size());
+	}
+	waitingGangs.push_back(gang);
+	startGangs();
+	check_pool_error(pthread_mutex_unlock(&mutex), "pthread_mutex_unlock");
+	return gang;
+}
+
+
+void ThreadPool::waitGang(Gang *gang)
+{
+	check_pool_error(pthread_mutex_lock(&mutex), "pthread_mutex_lock");
+	while (gang->running > 0) {
+		check_pool_error(pthread_cond_wait(&doneCond, &mutex),
+		                 "pthread_cond_wait");
+	}
+	check_pool_error(pthread_mutex_unlock(&mutex), "pthread_mutex_unlock");
+	delete gang;
+}
+
+
+void *ThreadPool::workerLoop(void *pool)
+{
+	ThreadPool *self = (ThreadPool *) pool;
+	check_pool_error(pthread_mutex_lock(&self->mutex), "pthread_mutex_lock");
+	while (true) {
+		while (self->readyTasks.empty() && !self->shuttingDown) {
+			check_pool_error(pthread_cond_wait(&self->readyCond, &self->mutex),
+			                 "pthread_cond_wait");
+		}
+		if (self->readyTasks.empty()) {
+			break;
+		}
+		std::pair<Gang *, int> readyTask = self->readyTasks.front();
+		self->readyTasks.pop_front();
+		check_pool_error(pthread_mutex_unlock(&self->mutex),
+		                 "pthread_mutex_unlock");
+
+		Gang *gang = readyTask.first;
+		gang->task(gang->args[readyTask.second]);
+
+		check_pool_error(pthread_mutex_lock(&self->mutex),
+		                 "pthread_mutex_lock");
+		self->idleWorkers++;
+		if (--gang->running == 0) {
+			check_pool_error(pthread_cond_broadcast(&self->doneCond),
+			                 "pthread_cond_broadcast");
+		}
+		self->startGangs();
+	}
+	check_pool_error(pthread_mutex_unlock(&self->mutex),
+	                 "pthread_mutex_unlock");
+	return NULL;
+}
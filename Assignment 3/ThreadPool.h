@@ -0,0 +1,56 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <utility>
+
+// a pool of worker threads that outlives the jobs running on it. Work is
+// submitted as gangs of tasks that all run at the same time on different
+// workers, since the tasks of one job wait for each other at barriers.
+// Gangs start in the order they were submitted as soon as enough workers
+// are idle, so jobs submitted together share the pool and a big gang is
+// never passed over by smaller ones. A gang bigger than the whole pool
+// first grows the pool.
+
+typedef void *(*gang_task_t)(void *);
+
+struct Gang;
+
+class ThreadPool {
+public:
+	// the pool shared by all the jobs of the process, created on first use
+	// with a worker per online CPU
+	static ThreadPool &shared();
+
+	ThreadPool(int numWorkers);
+	~ThreadPool();
+
+	// runs task(args[i]) for every i in [0, numTasks) on numTasks workers
+	// at the same time and returns without waiting for them
+	Gang *runGang(int numTasks, gang_task_t task, void **args);
+
+	// waits until all the tasks of the gang returned, and frees the gang
+	void waitGang(Gang *gang);
+
+private:
+	static void *workerLoop(void *pool);
+	void addWorkers(int count);
+	void startGangs();
+
+	pthread_mutex_t mutex;
+	// signaled when tasks are ready, and when the pool shuts down
+	pthread_cond_t readyCond;
+	// signaled when a gang finished
+	pthread_cond_t doneCond;
+	// gangs waiting for enough idle workers, oldest first
+	std::deque<Gang *> waitingGangs;
+	// tasks of started gangs that no worker picked yet
+	std::deque<std::pair<Gang *, int> > readyTasks;
+	std::vector<pthread_t> workers;
+	// workers neither running a task nor reserved for a ready one
+	int idleWorkers;
+	bool shuttingDown;
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,144 @@
+#include "BenchHarness.h"
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * runs one job of the workload and keeps its profile.
+ * @param workload - the workload to run
+ * @param input - the job's input
+ * @param num_threads - multiThreadLevel of the job
+ * @param stats - set to the profile of the job
+ */
+void run_job (Workload &workload, const InputVec &input, int num_threads,
+              JobStats &stats);
+
+/**
+ * prints one line of results.
+ * @param workload - the workload that ran
+ * @param num_pairs - the input size asked for
+ * @param num_threads - multiThreadLevel of the job
+ * @param stats - the fastest job's profile
+ * @param single_thread_seconds - total time of the same size on one thread
+ */
+void print_result (const Workload &workload, uint64_t num_pairs,
+                   int num_threads, const JobStats &stats,
+                   double single_thread_seconds);
+
+/**
+ * pairs per second of a phase, in millions.
+ * @param num_pairs - pairs the phase went through
+ * @param seconds - wall time of the phase
+ * @return throughput of the phase, 0 when it took no measurable time
+ */
+double mega_pairs_per_second (uint64_t num_pairs, double seconds);
+
+void run_job (Workload &workload, const InputVec &input, int num_threads,
+              JobStats &stats)
+{
+  OutputVec output;
+  JobHandle job = startMapReduceJob (workload.client (), input, output,
+                                     num_threads, workload.options ());
+  getJobStats (job, &stats);
+  closeJobHandle (job);
+  workload.free_output (output);
+}
+
+double mega_pairs_per_second (uint64_t num_pairs, double seconds)
+{
+  if (seconds <= 0)
+  {
+    return 0;
+  }
+  return (double) num_pairs / seconds / 1e6;
+}
+
+void print_result (const Workload &workload, uint64_t num_pairs,
+                   int num_threads, const JobStats &stats,
+                   double single_thread_seconds)
+{
+  uint64_t emitted = 0;
+  for (const ThreadStats &thread: stats.threads)
+  {
+    emitted += thread.pairs_emitted;
+  }
+  double speedup = single_thread_seconds / stats.total_seconds;
+  // map is measured by the pairs it emitted, the later phases by the pairs
+  // left after combining
+  printf ("%-14s %10lu %3d %9.4f %8.2f %8.2f %8.2f %8.2f %7.2f %6.2f "
+          "%10lu %9.1f\n",
+          workload.name (), (unsigned long) num_pairs, num_threads,
+          stats.total_seconds,
+          mega_pairs_per_second (emitted, stats.phase_seconds[MAP_PHASE]),
+          mega_pairs_per_second (stats.intermediate_pairs,
+                                 stats.phase_seconds[SORT_PHASE]),
+          mega_pairs_per_second (stats.intermediate_pairs,
+                                 stats.phase_seconds[SHUFFLE_PHASE]),
+          mega_pairs_per_second (stats.intermediate_pairs,
+                                 stats.phase_seconds[REDUCE_PHASE]),
+          speedup, speedup / num_threads,
+          (unsigned long) stats.largest_group,
+          (double) stats.peak_intermediate_bytes / (1 << 20));
+  fflush (stdout);
+}
+
+int run_benchmark (Workload &workload, int argc, char **argv)
+{
+  int max_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  uint64_t max_pairs = BENCH_DEFAULT_MAX_PAIRS;
+  int repeats = BENCH_DEFAULT_REPEATS;
+  if (argc > 1)
+  {
+    max_threads = atoi (argv[1]);
+  }
+  if (argc > 2)
+  {
+    max_pairs = strtoull (argv[2], nullptr, 10);
+  }
+  if (argc > 3)
+  {
+    repeats = atoi (argv[3]);
+  }
+  if (max_threads < 1 || max_pairs < BENCH_MIN_PAIRS || repeats < 1)
+  {
+    fprintf (stderr, "usage: %s [max_threads [max_pairs [repeats]]]\n",
+             argv[0]);
+    return 1;
+  }
+
+  printf ("%-14s %10s %3s %9s %8s %8s %8s %8s %7s %6s %10s %9s\n",
+          "workload", "pairs", "thr", "total_s", "map_Mps", "sort_Mps",
+          "shuf_Mps", "red_Mps", "speedup", "effic", "max_group",
+          "peak_MiB");
+  for (uint64_t num_pairs = BENCH_MIN_PAIRS; num_pairs <= max_pairs;
+       num_pairs *= 10)
+  {
+    // every size gets the same input however many sizes ran before it
+    std::mt19937_64 random (BENCH_SEED);
+    InputVec input;
+    workload.make_input (num_pairs, random, input);
+    double single_thread_seconds = 0;
+    for (int num_threads = 1; num_threads <= max_threads; ++num_threads)
+    {
+      JobStats best;
+      for (int r = 0; r < repeats; ++r)
+      {
+        JobStats stats;
+        run_job (workload, input, num_threads, stats);
+        if (r == 0 || stats.total_seconds < best.total_seconds)
+        {
+          best = stats;
+        }
+      }
+      if (num_threads == 1)
+      {
+        single_thread_seconds = best.total_seconds;
+      }
+      print_result (workload, num_pairs, num_threads, best,
+                    single_thread_seconds);
+    }
+    workload.free_input (input);
+  }
+  return 0;
+}
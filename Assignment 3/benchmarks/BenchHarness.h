@@ -0,0 +1,123 @@
+#ifndef BENCHHARNESS_H
+#define BENCHHARNESS_H
+
+#include "MapReduceFramework.h"
+#include "MapReduceFrameworkExt.h"
+#include <cstdint>
+#include <random>
+
+#define BENCH_MIN_PAIRS 10000
+#define BENCH_DEFAULT_MAX_PAIRS 1000000
+#define BENCH_DEFAULT_REPEATS 3
+#define BENCH_SEED 20240601
+
+/**
+ * key 2 and key 3 holding an integer, hashable so workloads may group by
+ * hash as well as by order
+ */
+class IntKey : public HashableK2, public K3
+{
+ public:
+  explicit IntKey (int64_t key) : key (key) {}
+  int64_t key;
+  bool operator< (const K2 &other) const override
+  {
+    return key < static_cast<const IntKey &> (other).key;
+  }
+  bool operator< (const K3 &other) const override
+  {
+    return key < static_cast<const IntKey &> (other).key;
+  }
+  std::size_t hash () const override
+  {
+    return std::hash<int64_t> () (key);
+  }
+  bool equals (const K2 &other) const override
+  {
+    return key == static_cast<const IntKey &> (other).key;
+  }
+};
+
+/**
+ * value 2 and value 3 holding a count
+ */
+class Count : public V2, public V3
+{
+ public:
+  explicit Count (uint64_t count) : count (count) {}
+  uint64_t count;
+};
+
+/**
+ * a benchmark workload: its client, its generated input and how to free
+ * what the input and the output own, the keys and values of both by default
+ */
+class Workload
+{
+ public:
+  virtual ~Workload () {}
+
+  virtual const char *name () const = 0;
+
+  virtual const MapReduceClient &client () const = 0;
+
+  virtual JobOptions options () const
+  {
+    return JobOptions ();
+  }
+
+  /**
+   * fills input with the items of a run, generated from random in the same
+   * way for every run of the same size.
+   * @param num_pairs - about how many intermediate pairs mapping the input
+   * emits
+   * @param random - generator seeded by the harness
+   * @param input - vector the items are added to
+   */
+  virtual void make_input (uint64_t num_pairs, std::mt19937_64 &random,
+                           InputVec &input) = 0;
+
+  /**
+   * deletes the keys and values of the input's items, and clears it
+   */
+  virtual void free_input (InputVec &input)
+  {
+    for (const InputPair &pair: input)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+    input.clear ();
+  }
+
+  /**
+   * deletes the keys and values of the output's pairs, and clears it
+   */
+  virtual void free_output (OutputVec &output)
+  {
+    for (const OutputPair &pair: output)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+    output.clear ();
+  }
+};
+
+/**
+ * runs a workload over input sizes from BENCH_MIN_PAIRS to a maximum,
+ * growing ten times at a time, and over 1 to a maximum number of threads.
+ * For every size and number of threads the fastest of a few repeats is
+ * printed as one line: the pairs per second of every phase, the speedup
+ * over one thread and the scaling efficiency, taken from getJobStats.
+ * The command line is [max_threads [max_pairs [repeats]]], the defaults
+ * being the online CPUs, BENCH_DEFAULT_MAX_PAIRS and
+ * BENCH_DEFAULT_REPEATS.
+ * @param workload - the workload to run
+ * @param argc - argc of main
+ * @param argv - argv of main
+ * @return exit code of the benchmark
+ */
+int run_benchmark (Workload &workload, int argc, char **argv);
+
+#endif //BENCHHARNESS_H
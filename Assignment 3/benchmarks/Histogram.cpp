@@ -0,0 +1,112 @@
+#include "BenchHarness.h"
+#include <algorithm>
+#include <vector>
+
+#define VALUES_PER_ITEM 256
+#define NUM_BUCKETS 1024
+#define BUCKET_WIDTH 1000
+
+/**
+ * histogram of generated normally distributed integers into fixed width
+ * buckets. There are few distinct keys, so the combiner folds nearly all
+ * the pairs, and the buckets are grouped by hash.
+ */
+
+class Values : public V1
+{
+ public:
+  std::vector<int64_t> values;
+};
+
+class HistogramClient : public CombinerClient
+{
+ public:
+  void map (const K1 *key, const V1 *value, void *context) const override
+  {
+    (void) key;
+    for (int64_t cur_value: static_cast<const Values *> (value)->values)
+    {
+      emit2 (new IntKey (cur_value / BUCKET_WIDTH), new Count (1), context);
+    }
+  }
+
+  V2 *combine (const IntermediateVec *pairs) const override
+  {
+    uint64_t sum = 0;
+    for (std::size_t i = 0; i < pairs->size (); ++i)
+    {
+      sum += static_cast<Count *> ((*pairs)[i].second)->count;
+      if (i > 0)
+      {
+        delete (*pairs)[i].first;
+      }
+      delete (*pairs)[i].second;
+    }
+    return new Count (sum);
+  }
+
+  void reduce (const IntermediateVec *pairs, void *context) const override
+  {
+    uint64_t sum = 0;
+    for (const IntermediatePair &pair: *pairs)
+    {
+      sum += static_cast<Count *> (pair.second)->count;
+    }
+    emit3 (new IntKey (static_cast<IntKey *> (pairs->front ().first)->key),
+           new Count (sum), context);
+    for (const IntermediatePair &pair: *pairs)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+};
+
+class HistogramWorkload : public Workload
+{
+ public:
+  const char *name () const override
+  {
+    return "histogram";
+  }
+
+  const MapReduceClient &client () const override
+  {
+    return histogram;
+  }
+
+  JobOptions options () const override
+  {
+    JobOptions options;
+    options.grouping = HASH_GROUPING;
+    return options;
+  }
+
+  void make_input (uint64_t num_pairs, std::mt19937_64 &random,
+                   InputVec &input) override
+  {
+    double middle = (double) NUM_BUCKETS * BUCKET_WIDTH / 2;
+    std::normal_distribution<double> value (middle, middle / 4);
+    for (uint64_t i = 0; i < num_pairs / VALUES_PER_ITEM; ++i)
+    {
+      Values *values = new Values;
+      values->values.resize (VALUES_PER_ITEM);
+      for (int64_t &cur_value: values->values)
+      {
+        // values out of the histogram's range fall into its edge buckets
+        cur_value = std::min (std::max ((int64_t) value (random), (int64_t) 0),
+                              (int64_t) NUM_BUCKETS * BUCKET_WIDTH - 1);
+      }
+      input.push_back (InputPair (nullptr, values));
+    }
+  }
+
+ private:
+  HistogramClient histogram;
+};
+
+int main (int argc, char **argv)
+{
+  HistogramWorkload workload;
+  return run_benchmark (workload, argc, argv);
+}
@@ -0,0 +1,117 @@
+#include "BenchHarness.h"
+#include <algorithm>
+#include <vector>
+
+#define VOCABULARY_SIZE 100000
+#define WORDS_PER_DOCUMENT 64
+
+/**
+ * inverted index over generated documents of word ids: every word is mapped
+ * to the sorted list of the documents it appears in. No pairs are combined,
+ * so every emitted pair goes through the shuffle.
+ */
+
+class DocumentId : public K1
+{
+ public:
+  explicit DocumentId (int64_t id) : id (id) {}
+  int64_t id;
+  bool operator< (const K1 &other) const override
+  {
+    return id < static_cast<const DocumentId &> (other).id;
+  }
+};
+
+class Document : public V1
+{
+ public:
+  std::vector<int64_t> words;
+};
+
+class Posting : public V2
+{
+ public:
+  explicit Posting (int64_t document) : document (document) {}
+  int64_t document;
+};
+
+class PostingList : public V3
+{
+ public:
+  std::vector<int64_t> documents;
+};
+
+class InvertedIndexClient : public MapReduceClient
+{
+ public:
+  void map (const K1 *key, const V1 *value, void *context) const override
+  {
+    int64_t document = static_cast<const DocumentId *> (key)->id;
+    // a document is listed once per word however often the word appears
+    std::vector<int64_t> words = static_cast<const Document *> (value)->words;
+    std::sort (words.begin (), words.end ());
+    words.erase (std::unique (words.begin (), words.end ()), words.end ());
+    for (int64_t word: words)
+    {
+      emit2 (new IntKey (word), new Posting (document), context);
+    }
+  }
+
+  void reduce (const IntermediateVec *pairs, void *context) const override
+  {
+    PostingList *list = new PostingList;
+    list->documents.reserve (pairs->size ());
+    for (const IntermediatePair &pair: *pairs)
+    {
+      list->documents.push_back (
+          static_cast<Posting *> (pair.second)->document);
+    }
+    std::sort (list->documents.begin (), list->documents.end ());
+    emit3 (new IntKey (static_cast<IntKey *> (pairs->front ().first)->key),
+           list, context);
+    for (const IntermediatePair &pair: *pairs)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+};
+
+class InvertedIndexWorkload : public Workload
+{
+ public:
+  const char *name () const override
+  {
+    return "invertedindex";
+  }
+
+  const MapReduceClient &client () const override
+  {
+    return inverted_index;
+  }
+
+  void make_input (uint64_t num_pairs, std::mt19937_64 &random,
+                   InputVec &input) override
+  {
+    std::uniform_int_distribution<int64_t> pick (0, VOCABULARY_SIZE - 1);
+    for (uint64_t i = 0; i < num_pairs / WORDS_PER_DOCUMENT; ++i)
+    {
+      Document *document = new Document;
+      document->words.resize (WORDS_PER_DOCUMENT);
+      for (int64_t &word: document->words)
+      {
+        word = pick (random);
+      }
+      input.push_back (InputPair (new DocumentId ((int64_t) i), document));
+    }
+  }
+
+ private:
+  InvertedIndexClient inverted_index;
+};
+
+int main (int argc, char **argv)
+{
+  InvertedIndexWorkload workload;
+  return run_benchmark (workload, argc, argv);
+}
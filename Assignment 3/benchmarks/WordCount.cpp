@@ -0,0 +1,140 @@
+#include "BenchHarness.h"
+#include <string>
+
+#define VOCABULARY_SIZE 50000
+#define MIN_WORD_LENGTH 3
+#define MAX_WORD_LENGTH 10
+#define WORDS_PER_LINE 16
+
+/**
+ * word count over a generated corpus of lines of words drawn uniformly from
+ * a vocabulary of random words, folded by a combiner
+ */
+
+class Line : public V1
+{
+ public:
+  std::string text;
+};
+
+class Word : public K2, public K3
+{
+ public:
+  explicit Word (const std::string &word) : word (word) {}
+  std::string word;
+  bool operator< (const K2 &other) const override
+  {
+    return word < static_cast<const Word &> (other).word;
+  }
+  bool operator< (const K3 &other) const override
+  {
+    return word < static_cast<const Word &> (other).word;
+  }
+};
+
+class WordCountClient : public CombinerClient
+{
+ public:
+  void map (const K1 *key, const V1 *value, void *context) const override
+  {
+    (void) key;
+    const std::string &text = static_cast<const Line *> (value)->text;
+    std::size_t begin = 0;
+    while (begin < text.size ())
+    {
+      std::size_t end = text.find (' ', begin);
+      if (end == std::string::npos)
+      {
+        end = text.size ();
+      }
+      emit2 (new Word (text.substr (begin, end - begin)), new Count (1),
+             context);
+      begin = end + 1;
+    }
+  }
+
+  V2 *combine (const IntermediateVec *pairs) const override
+  {
+    uint64_t sum = 0;
+    for (std::size_t i = 0; i < pairs->size (); ++i)
+    {
+      sum += static_cast<Count *> ((*pairs)[i].second)->count;
+      if (i > 0)
+      {
+        delete (*pairs)[i].first;
+      }
+      delete (*pairs)[i].second;
+    }
+    return new Count (sum);
+  }
+
+  void reduce (const IntermediateVec *pairs, void *context) const override
+  {
+    uint64_t sum = 0;
+    for (const IntermediatePair &pair: *pairs)
+    {
+      sum += static_cast<Count *> (pair.second)->count;
+    }
+    emit3 (new Word (static_cast<Word *> (pairs->front ().first)->word),
+           new Count (sum), context);
+    for (const IntermediatePair &pair: *pairs)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+};
+
+class WordCountWorkload : public Workload
+{
+ public:
+  const char *name () const override
+  {
+    return "wordcount";
+  }
+
+  const MapReduceClient &client () const override
+  {
+    return word_count;
+  }
+
+  void make_input (uint64_t num_pairs, std::mt19937_64 &random,
+                   InputVec &input) override
+  {
+    std::uniform_int_distribution<int> letter ('a', 'z');
+    std::uniform_int_distribution<int> length (MIN_WORD_LENGTH,
+                                               MAX_WORD_LENGTH);
+    std::vector<std::string> vocabulary (VOCABULARY_SIZE);
+    for (std::string &word: vocabulary)
+    {
+      word.resize (length (random));
+      for (char &c: word)
+      {
+        c = (char) letter (random);
+      }
+    }
+    std::uniform_int_distribution<int> pick (0, VOCABULARY_SIZE - 1);
+    for (uint64_t i = 0; i < num_pairs / WORDS_PER_LINE; ++i)
+    {
+      Line *line = new Line;
+      for (int w = 0; w < WORDS_PER_LINE; ++w)
+      {
+        if (w > 0)
+        {
+          line->text += ' ';
+        }
+        line->text += vocabulary[pick (random)];
+      }
+      input.push_back (InputPair (nullptr, line));
+    }
+  }
+
+ private:
+  WordCountClient word_count;
+};
+
+int main (int argc, char **argv)
+{
+  WordCountWorkload workload;
+  return run_benchmark (workload, argc, argv);
+}
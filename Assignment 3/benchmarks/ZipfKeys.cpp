@@ -0,0 +1,99 @@
+#include "BenchHarness.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define NUM_KEYS 1000000
+#define ZIPF_EXPONENT 1.1
+#define KEYS_PER_ITEM 256
+
+/**
+ * counts keys drawn from a Zipf distribution, so a few keys have most of
+ * the pairs. There is no combiner, so the biggest groups reach reduce whole
+ * and show how the framework handles skew.
+ */
+
+class Keys : public V1
+{
+ public:
+  std::vector<int64_t> keys;
+};
+
+class ZipfClient : public MapReduceClient
+{
+ public:
+  void map (const K1 *key, const V1 *value, void *context) const override
+  {
+    (void) key;
+    for (int64_t cur_key: static_cast<const Keys *> (value)->keys)
+    {
+      emit2 (new IntKey (cur_key), new Count (1), context);
+    }
+  }
+
+  void reduce (const IntermediateVec *pairs, void *context) const override
+  {
+    uint64_t sum = 0;
+    for (const IntermediatePair &pair: *pairs)
+    {
+      sum += static_cast<Count *> (pair.second)->count;
+    }
+    emit3 (new IntKey (static_cast<IntKey *> (pairs->front ().first)->key),
+           new Count (sum), context);
+    for (const IntermediatePair &pair: *pairs)
+    {
+      delete pair.first;
+      delete pair.second;
+    }
+  }
+};
+
+class ZipfWorkload : public Workload
+{
+ public:
+  const char *name () const override
+  {
+    return "zipf";
+  }
+
+  const MapReduceClient &client () const override
+  {
+    return zipf;
+  }
+
+  void make_input (uint64_t num_pairs, std::mt19937_64 &random,
+                   InputVec &input) override
+  {
+    // key k is drawn with probability proportional to 1 / (k + 1)^s, by a
+    // binary search of the distribution's cumulative weights
+    std::vector<double> cumulative (NUM_KEYS);
+    double total = 0;
+    for (int k = 0; k < NUM_KEYS; ++k)
+    {
+      total += 1 / std::pow ((double) (k + 1), ZIPF_EXPONENT);
+      cumulative[k] = total;
+    }
+    std::uniform_real_distribution<double> draw (0, total);
+    for (uint64_t i = 0; i < num_pairs / KEYS_PER_ITEM; ++i)
+    {
+      Keys *keys = new Keys;
+      keys->keys.resize (KEYS_PER_ITEM);
+      for (int64_t &key: keys->keys)
+      {
+        key = std::lower_bound (cumulative.begin (), cumulative.end (),
+                                draw (random)) - cumulative.begin ();
+        key = std::min (key, (int64_t) NUM_KEYS - 1);
+      }
+      input.push_back (InputPair (nullptr, keys));
+    }
+  }
+
+ private:
+  ZipfClient zipf;
+};
+
+int main (int argc, char **argv)
+{
+  ZipfWorkload workload;
+  return run_benchmark (workload, argc, argv);
+}
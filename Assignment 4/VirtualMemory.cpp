@@ -1,80 +1,291 @@
 #include "VirtualMemory.h"
+#include "VirtualMemoryExt.h"
 #include "PhysicalMemory.h"
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TLB_SETS 16
+#define TLB_WAYS 4
+#define LRU_SAMPLES 5
+#define READAHEAD_STREAMS 4
+#define READAHEAD_MAX_PAGES 16
+#define READAHEAD_MAX_STRIDE 8
+#define READAHEAD_PERIOD 32
+#define FRAME_WRITER (1 << 30)
+// set in a table entry mapping a huge page, along with its first frame
+#define HUGE_ENTRY (1 << (WORD_WIDTH - 2))
 
 /*
- * Initialize the virtual memory.
+ * a cached translation of a page to the frame it is mapped to
  */
-void VMinitialize ()
+typedef struct
 {
-  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+    uint64_t page;
+    word_t frame;
+    // whether the entry translates the pages of a huge page, page then
+    // being their number >> OFFSET_WIDTH and frame the first of theirs
+    bool huge;
+    bool valid;
+    uint64_t last_use;
+} tlb_entry;
+
+// translations of pages the thread used recently. Page p can only be
+// cached in set p % TLB_SETS, and the least recently used way of the set is
+// replaced. An entry may outlive the page's mapping when another thread
+// evicts it, so a translation is checked against the frame before use
+static thread_local tlb_entry tlb[TLB_SETS][TLB_WAYS];
+static thread_local uint64_t tlb_clock = 0;
+// bumped by VMinitialize. A thread whose TLB was filled before the bump
+// flushes it on its next lookup, since VMinitialize can't reach the TLBs of
+// the other threads
+static std::atomic<uint64_t> tlb_generation (0);
+static thread_local uint64_t tlb_seen_generation = 0;
+
+/*
+ * where a frame in use is linked into the tree of tables
+ */
+typedef struct
+{
+    // the table pointing to the frame, and the index of its entry there
+    word_t parent;
+    uint64_t slot;
+    // entries of a table frame that point to frames
+    uint64_t refs;
+    // whether the frame holds a page, and the page's number
+    bool leaf;
+    uint64_t page;
+    // whether the page was read ahead and not accessed since
+    std::atomic<bool> prefetched;
+    // whether the page is one of a huge page. parent and slot are then
+    // those of the huge page's entry
+    std::atomic<bool> huge;
+    // whether the page was written since it was restored
+    std::atomic<bool> dirty;
+    // whether dropping the frame loses nothing unless the page is dirty
+    bool backed;
+} frame_data;
+
+/*
+ * Threads translate addresses and access pages in parallel. Changes to the
+ * tables, and everything done on a fault, happen under fault_mutex.
+ * leaf and page of a frame are only changed while its lock is held
+ * exclusively, and a thread accessing a page holds the lock of its frame
+ * shared from checking them until the access is done, so the page is not
+ * evicted under it. The words of a frame that is not a page, a table or a
+ * frame being filled, are likewise only written or restored while its lock
+ * is held exclusively, and the walks outside fault_mutex read a table's
+ * entry with its lock held shared.
+ */
+static std::mutex fault_mutex;
+// the number of threads holding a frame's lock shared, with FRAME_WRITER
+// set while a writer holds it or waits for the readers to leave
+static std::atomic<int> frame_locks[NUM_FRAMES];
+
+static frame_data frames[NUM_FRAMES];
+// frames [next_unused_frame, NUM_FRAMES) were never used
+static word_t next_unused_frame = 1;
+// frames of tables that lost their last entry, ready to be used again
+static word_t free_frames[NUM_FRAMES];
+static uint64_t num_free_frames = 0;
+// the pages with a copy in the swap. The swap gives up the copy of a page
+// restored from it
+static std::vector<bool> swapped;
+
+// the counts VMgetStats reports
+static std::atomic<uint64_t> page_faults (0);
+static std::atomic<uint64_t> pages_read_ahead (0);
+static std::atomic<uint64_t> read_ahead_hits (0);
+static std::atomic<uint64_t> evictions (0);
+static std::atomic<uint64_t> write_backs (0);
+static std::atomic<uint64_t> write_backs_saved (0);
+static std::atomic<uint64_t> huge_pages_made (0);
+static std::atomic<uint64_t> huge_pages_split (0);
+
+/*
+ * a run of faults a fixed number of pages apart, such as a scan
+ */
+typedef struct
+{
+    uint64_t last_page;
+    // pages between the faults, 0 until a second fault joins the stream
+    int64_t stride;
+    // the page the stream's next fault is expected at, past the pages
+    // read ahead for it
+    uint64_t next_page;
+    // pages read ahead on the stream's faults, doubling while it goes on
+    uint64_t window;
+    uint64_t last_use;
+} stream_data;
+
+static stream_data streams[READAHEAD_STREAMS];
+static uint64_t stream_clock = 0;
+// the largest window of any stream, halved when most pages read ahead are
+// evicted before they are accessed. At 0 no pages are read ahead, until
+// enough faults land where the streams expected them
+static std::atomic<uint64_t> readahead_limit (0);
+// pages read ahead and accessed, or evicted unused, since the limit was
+// last adjusted. Pages are accessed outside fault_mutex, so the counts have
+// their own lock
+static std::mutex readahead_mutex;
+static uint64_t period_hits = 0;
+static uint64_t period_misses = 0;
+
+void tlb_flush ()
+{
+  for (uint64_t i = 0; i < TLB_SETS; ++i)
   {
-    PMwrite (j, 0);
+    for (uint64_t j = 0; j < TLB_WAYS; ++j)
+    {
+      tlb[i][j].valid = false;
+    }
   }
+  tlb_seen_generation = tlb_generation;
 }
 
-word_t max_available_frame (word_t root_frame = 0, uint64_t depth = 0)
+bool tlb_lookup (uint64_t page_number, word_t &frame)
 {
-  if (depth == TABLES_DEPTH)
+  if (tlb_seen_generation != tlb_generation)
   {
-    return root_frame;
+    tlb_flush ();
+    return false;
   }
-  word_t max_frame = root_frame;
-  word_t child_val = 0;
-
-  for (uint64_t i = 0; i < PAGE_SIZE; ++i)
+  tlb_entry *set = tlb[page_number % TLB_SETS];
+  for (uint64_t j = 0; j < TLB_WAYS; ++j)
   {
-    PMread ((uint64_t) (root_frame) * PAGE_SIZE + i, &child_val);
-    if (child_val != 0)
+    if (set[j].valid && !set[j].huge && set[j].page == page_number)
     {
-      word_t cur_frame = max_available_frame (child_val, depth + 1);
-      if (cur_frame > max_frame)
-      {
-        max_frame = cur_frame;
-      }
+      set[j].last_use = ++tlb_clock;
+      frame = set[j].frame;
+      return true;
+    }
+  }
+  uint64_t huge_page = page_number >> OFFSET_WIDTH;
+  set = tlb[huge_page % TLB_SETS];
+  for (uint64_t j = 0; j < TLB_WAYS; ++j)
+  {
+    if (set[j].valid && set[j].huge && set[j].page == huge_page)
+    {
+      set[j].last_use = ++tlb_clock;
+      frame = set[j].frame + (word_t) (page_number & (PAGE_SIZE - 1));
+      return true;
     }
   }
-  return max_frame;
+  return false;
 }
 
-word_t
-empty_frame (word_t original_frame, word_t node_parent = 0, word_t cur_node = 0,
-             uint64_t child_number = 0, uint64_t depth = 0)
+void tlb_insert (uint64_t page_number, word_t frame)
 {
-  if (depth == TABLES_DEPTH || cur_node == original_frame)
+  // a single entry covers all the pages of a huge page
+  bool huge = frames[frame].huge;
+  if (huge)
   {
-    return 0;
+    frame -= (word_t) (page_number & (PAGE_SIZE - 1));
+    page_number >>= OFFSET_WIDTH;
   }
-
-  uint64_t childs_sum = 0;
-  word_t child_val = 0;
-
-  for (uint64_t i = 0; i < PAGE_SIZE; ++i)
+  tlb_entry *set = tlb[page_number % TLB_SETS];
+  uint64_t victim = 0;
+  for (uint64_t j = 0; j < TLB_WAYS; ++j)
   {
-    child_val = 0;
-    PMread ((uint64_t) (cur_node) * PAGE_SIZE + i, &child_val);
-    childs_sum += child_val;
+    if (!set[j].valid)
+    {
+      victim = j;
+      break;
+    }
+    if (set[j].last_use < set[victim].last_use)
+    {
+      victim = j;
+    }
   }
+  set[victim] = {page_number, frame, huge, true, ++tlb_clock};
+}
 
-  if (childs_sum == 0)
+void tlb_invalidate (uint64_t page_number)
+{
+  tlb_entry *set = tlb[page_number % TLB_SETS];
+  for (uint64_t j = 0; j < TLB_WAYS; ++j)
   {
-    PMwrite ((uint64_t) (node_parent) * PAGE_SIZE + child_number, 0);
-    return cur_node;
+    if (set[j].valid && !set[j].huge && set[j].page == page_number)
+    {
+      set[j].valid = false;
+    }
   }
+  uint64_t huge_page = page_number >> OFFSET_WIDTH;
+  set = tlb[huge_page % TLB_SETS];
+  for (uint64_t j = 0; j < TLB_WAYS; ++j)
+  {
+    if (set[j].valid && set[j].huge && set[j].page == huge_page)
+    {
+      set[j].valid = false;
+    }
+  }
+}
 
-  for (uint64_t i = 0; i < PAGE_SIZE; ++i)
+void lock_frame_shared (word_t frame)
+{
+  while (true)
   {
-    PMread ((uint64_t) (cur_node) * PAGE_SIZE + i, &child_val);
-    if (child_val != 0)
+    int state = frame_locks[frame].load (std::memory_order_relaxed);
+    if (!(state & FRAME_WRITER)
+        && frame_locks[frame].compare_exchange_weak (
+            state, state + 1, std::memory_order_acquire))
     {
-      word_t cur_frame = empty_frame (original_frame, cur_node, child_val,
-                                      i, depth + 1);
-      if (cur_frame != 0)
-      {
-        return cur_frame;
-      }
+      return;
     }
+    std::this_thread::yield ();
   }
-  return 0;
+}
+
+void unlock_frame_shared (word_t frame)
+{
+  frame_locks[frame].fetch_sub (1, std::memory_order_release);
+}
+
+/*
+ * only called under fault_mutex, so there is a single writer. New readers
+ * are held off while it waits for the current ones to leave.
+ */
+void lock_frame_exclusive (word_t frame)
+{
+  frame_locks[frame].fetch_or (FRAME_WRITER, std::memory_order_relaxed);
+  while (frame_locks[frame].load (std::memory_order_acquire) != FRAME_WRITER)
+  {
+    std::this_thread::yield ();
+  }
+}
+
+void unlock_frame_exclusive (word_t frame)
+{
+  frame_locks[frame].store (0, std::memory_order_release);
+}
+
+/*
+ * locks frame shared if it holds page_number.
+ * returns whether it does, leaving the frame unlocked when it does not
+ */
+bool lock_page (word_t frame, uint64_t page_number)
+{
+  lock_frame_shared (frame);
+  if (frames[frame].leaf && frames[frame].page == page_number)
+  {
+    return true;
+  }
+  unlock_frame_shared (frame);
+  return false;
+}
+
+/*
+ * sets the entry at slot of a table, away from the walks of other threads
+ */
+void write_entry (word_t table, uint64_t slot, word_t value)
+{
+  lock_frame_exclusive (table);
+  PMwrite ((uint64_t) (table) * PAGE_SIZE + slot, value);
+  unlock_frame_exclusive (table);
 }
 
 uint64_t min_distance (uint64_t new_page, uint64_t cur_address)
@@ -126,6 +337,22 @@ evict_page (uint64_t new_page, uint64_t temp_page = 0, word_t cur_node = 0,
     if (child_frame != 0)
     {
       uint64_t new_address = (temp_page << OFFSET_WIDTH) + i;
+      if (child_frame & HUGE_ENTRY)
+      {
+        // the pages of a huge page lie in consecutive frames
+        word_t first_frame = child_frame & ~HUGE_ENTRY;
+        for (int j = 0; j < PAGE_SIZE; ++j)
+        {
+          uint64_t page = (new_address << OFFSET_WIDTH) + j;
+          uint64_t distance = min_distance (new_page, page);
+          if (distance > final_data.max_distance)
+          {
+            final_data = {distance, page, first_frame + j, cur_node,
+                          (uint64_t) i};
+          }
+        }
+        continue;
+      }
       min_index_distance data = evict_page (new_page, new_address, child_frame,
                                             cur_node, i,
                                             depth + 1);
@@ -138,65 +365,781 @@ evict_page (uint64_t new_page, uint64_t temp_page = 0, word_t cur_node = 0,
   return final_data;
 }
 
-void
-find_frame (word_t cur_frame, word_t &new_frame, uint64_t page_number, bool &max_frames_found)
+/*
+ * chooses the pages evicted when no frame is free. A policy is told about
+ * every page mapped to a frame, every later access to it, and every page
+ * unmapped, and choose_victim returns the frame of a mapped page.
+ */
+class ReplacementPolicy
+{
+ public:
+  virtual ~ReplacementPolicy ()
+  {}
+
+  virtual void reset ()
+  {}
+
+  virtual void page_mapped (word_t frame)
+  {
+    (void) frame;
+  }
+
+  virtual void page_accessed (word_t frame)
+  {
+    (void) frame;
+  }
+
+  virtual void page_unmapped (word_t frame)
+  {
+    (void) frame;
+  }
+
+  virtual word_t choose_victim (uint64_t new_page) = 0;
+};
+
+class CyclicDistancePolicy : public ReplacementPolicy
 {
-  new_frame = empty_frame (cur_frame);
-  if (new_frame != 0)
+ public:
+  word_t choose_victim (uint64_t new_page) override
+  {
+    return evict_page (new_page).evicted_frame;
+  }
+};
+
+/*
+ * the hand sweeps the frames, evicting the first page not accessed since
+ * the hand last passed it
+ */
+class ClockPolicy : public ReplacementPolicy
+{
+ public:
+  void reset () override
+  {
+    std::fill (referenced, referenced + NUM_FRAMES, false);
+    hand = 1;
+  }
+
+  void page_mapped (word_t frame) override
+  {
+    referenced[frame] = true;
+  }
+
+  void page_accessed (word_t frame) override
+  {
+    referenced[frame] = true;
+  }
+
+  word_t choose_victim (uint64_t new_page) override
+  {
+    (void) new_page;
+    while (true)
+    {
+      word_t frame = hand;
+      hand = hand + 1 < NUM_FRAMES ? hand + 1 : 1;
+      if (frames[frame].leaf)
+      {
+        if (!referenced[frame])
+        {
+          return frame;
+        }
+        referenced[frame] = false;
+      }
+    }
+  }
+
+ private:
+  // set by threads accessing pages outside fault_mutex
+  std::atomic<bool> referenced[NUM_FRAMES];
+  word_t hand;
+};
+
+/*
+ * evicts the least recently used of LRU_SAMPLES pages drawn at random
+ */
+class LruPolicy : public ReplacementPolicy
+{
+ public:
+  void reset () override
+  {
+    clock = 0;
+    random_state = 1;
+    leaves.clear ();
+  }
+
+  void page_mapped (word_t frame) override
+  {
+    last_use[frame] = ++clock;
+    position[frame] = leaves.size ();
+    leaves.push_back (frame);
+  }
+
+  void page_accessed (word_t frame) override
+  {
+    last_use[frame] = ++clock;
+  }
+
+  void page_unmapped (word_t frame) override
+  {
+    word_t last = leaves.back ();
+    leaves[position[frame]] = last;
+    position[last] = position[frame];
+    leaves.pop_back ();
+  }
+
+  word_t choose_victim (uint64_t new_page) override
+  {
+    (void) new_page;
+    word_t victim = leaves[next_random () % leaves.size ()];
+    for (int i = 1; i < LRU_SAMPLES; ++i)
+    {
+      word_t frame = leaves[next_random () % leaves.size ()];
+      if (last_use[frame] < last_use[victim])
+      {
+        victim = frame;
+      }
+    }
+    return victim;
+  }
+
+ private:
+  uint64_t next_random ()
+  {
+    // xorshift, the samples only need to be spread, not unpredictable
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+  }
+
+  // set by threads accessing pages outside fault_mutex
+  std::atomic<uint64_t> last_use[NUM_FRAMES];
+  // index of every leaf frame in leaves
+  uint64_t position[NUM_FRAMES];
+  std::vector<word_t> leaves;
+  std::atomic<uint64_t> clock;
+  uint64_t random_state;
+};
+
+/*
+ * adaptive replacement cache: pages accessed once since they were mapped
+ * are kept apart from pages accessed again, and pages recently evicted
+ * from either list are remembered to tell which list deserves more frames
+ */
+class ArcPolicy : public ReplacementPolicy
+{
+ public:
+  void reset () override
+  {
+    std::lock_guard<std::mutex> guard (lists_mutex);
+    recent.clear ();
+    frequent.clear ();
+    recent_ghosts.clear ();
+    frequent_ghosts.clear ();
+    ghosts.clear ();
+    target = 0;
+  }
+
+  void page_mapped (word_t frame) override
+  {
+    std::lock_guard<std::mutex> guard (lists_mutex);
+    uint64_t capacity = NUM_FRAMES - 1;
+    auto ghost = ghosts.find (frames[frame].page);
+    if (ghost == ghosts.end ())
+    {
+      recent.push_front (frame);
+      positions[frame] = recent.begin ();
+      in_frequent[frame] = false;
+      if (recent.size () + recent_ghosts.size () > capacity
+          && !recent_ghosts.empty ())
+      {
+        ghosts.erase (recent_ghosts.back ());
+        recent_ghosts.pop_back ();
+      }
+      if (recent.size () + frequent.size () + recent_ghosts.size ()
+          + frequent_ghosts.size () > 2 * capacity
+          && !frequent_ghosts.empty ())
+      {
+        ghosts.erase (frequent_ghosts.back ());
+        frequent_ghosts.pop_back ();
+      }
+      return;
+    }
+    // a page evicted lately is back, so its list should have kept it
+    if (!ghost->second.frequent)
+    {
+      uint64_t step = std::max<uint64_t> (
+          1, frequent_ghosts.size () / recent_ghosts.size ());
+      target = std::min (capacity, target + step);
+      recent_ghosts.erase (ghost->second.position);
+    }
+    else
+    {
+      uint64_t step = std::max<uint64_t> (
+          1, recent_ghosts.size () / frequent_ghosts.size ());
+      target -= std::min (target, step);
+      frequent_ghosts.erase (ghost->second.position);
+    }
+    ghosts.erase (ghost);
+    frequent.push_front (frame);
+    positions[frame] = frequent.begin ();
+    in_frequent[frame] = true;
+  }
+
+  void page_accessed (word_t frame) override
+  {
+    std::lock_guard<std::mutex> guard (lists_mutex);
+    std::list<word_t> &from = in_frequent[frame] ? frequent : recent;
+    frequent.splice (frequent.begin (), from, positions[frame]);
+    in_frequent[frame] = true;
+  }
+
+  void page_unmapped (word_t frame) override
+  {
+    std::lock_guard<std::mutex> guard (lists_mutex);
+    uint64_t page = frames[frame].page;
+    if (in_frequent[frame])
+    {
+      frequent.erase (positions[frame]);
+      frequent_ghosts.push_front (page);
+      ghosts[page] = {frequent_ghosts.begin (), true};
+    }
+    else
+    {
+      recent.erase (positions[frame]);
+      recent_ghosts.push_front (page);
+      ghosts[page] = {recent_ghosts.begin (), false};
+    }
+  }
+
+  word_t choose_victim (uint64_t new_page) override
+  {
+    std::lock_guard<std::mutex> guard (lists_mutex);
+    auto ghost = ghosts.find (new_page);
+    bool frequent_ghost = ghost != ghosts.end () && ghost->second.frequent;
+    if (!recent.empty () && (frequent.empty () || recent.size () > target
+                             || (frequent_ghost && recent.size () == target)))
+    {
+      return recent.back ();
+    }
+    return frequent.back ();
+  }
+
+ private:
+  typedef struct
+  {
+      std::list<uint64_t>::iterator position;
+      bool frequent;
+  } ghost_entry;
+
+  // pages are accessed outside fault_mutex, and an access moves its page
+  std::mutex lists_mutex;
+  // frames of mapped pages, most recently used first
+  std::list<word_t> recent;
+  std::list<word_t> frequent;
+  std::list<word_t>::iterator positions[NUM_FRAMES];
+  bool in_frequent[NUM_FRAMES];
+  // pages evicted from each list, most recently evicted first
+  std::list<uint64_t> recent_ghosts;
+  std::list<uint64_t> frequent_ghosts;
+  std::unordered_map<uint64_t, ghost_entry> ghosts;
+  // number of frames the recent list aims for
+  uint64_t target;
+};
+
+static CyclicDistancePolicy cyclic_distance_policy;
+static ClockPolicy clock_policy;
+static LruPolicy lru_policy;
+static ArcPolicy arc_policy;
+// indexed by replacement_policy_t
+static ReplacementPolicy *const policies[] = {&cyclic_distance_policy,
+                                              &clock_policy, &lru_policy,
+                                              &arc_policy};
+static replacement_policy_t selected_policy = CYCLIC_DISTANCE_POLICY;
+static ReplacementPolicy *policy = &cyclic_distance_policy;
+
+void VMsetReplacementPolicy (replacement_policy_t new_policy)
+{
+  selected_policy = new_policy;
+}
+
+/*
+ * the largest number of pages read ahead on a fault. A quarter of the
+ * frames, so a window does not evict the pages of the window before it
+ */
+uint64_t max_readahead ()
+{
+  return std::min<uint64_t> (READAHEAD_MAX_PAGES, NUM_FRAMES / 4);
+}
+
+/*
+ * counts a page read ahead that was accessed, or evicted unused, and every
+ * READAHEAD_PERIOD pages adjusts the readahead limit to how many were used.
+ */
+void prefetch_resolved (bool hit)
+{
+  std::lock_guard<std::mutex> guard (readahead_mutex);
+  if (hit)
+  {
+    period_hits++;
+  }
+  else
+  {
+    period_misses++;
+  }
+  if (period_hits + period_misses < READAHEAD_PERIOD)
   {
     return;
   }
-  if (!max_frames_found)
+  if (period_misses > period_hits)
+  {
+    readahead_limit = readahead_limit / 2;
+  }
+  else
+  {
+    readahead_limit = std::min<uint64_t> (max_readahead (), std::max<uint64_t> (
+        1, 2 * readahead_limit));
+  }
+  period_hits = 0;
+  period_misses = 0;
+}
+
+/*
+ * Initialize the virtual memory.
+ */
+void VMinitialize ()
+{
+  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+  {
+    PMwrite (j, 0);
+  }
+  tlb_generation++;
+  for (uint64_t f = 0; f < NUM_FRAMES; ++f)
+  {
+    frames[f].refs = 0;
+    frames[f].leaf = false;
+    frames[f].prefetched = false;
+    frames[f].huge = false;
+    frame_locks[f] = 0;
+  }
+  swapped.assign (NUM_PAGES, false);
+  page_faults = 0;
+  pages_read_ahead = 0;
+  read_ahead_hits = 0;
+  evictions = 0;
+  write_backs = 0;
+  write_backs_saved = 0;
+  huge_pages_made = 0;
+  huge_pages_split = 0;
+  next_unused_frame = 1;
+  num_free_frames = 0;
+  for (uint64_t i = 0; i < READAHEAD_STREAMS; ++i)
+  {
+    streams[i] = {0, 0, 0, 0, 0};
+  }
+  stream_clock = 0;
+  readahead_limit = max_readahead ();
+  period_hits = 0;
+  period_misses = 0;
+  policy = policies[selected_policy];
+  policy->reset ();
+}
+
+void map_frame (word_t parent, uint64_t slot, word_t frame)
+{
+  write_entry (parent, slot, frame);
+  frames[frame].parent = parent;
+  frames[frame].slot = slot;
+  frames[frame].refs = 0;
+  frames[parent].refs++;
+}
+
+/*
+ * unlinks a frame from its table. A table left without entries is unlinked
+ * as well and its frame freed, unless it is the root or kept_frame.
+ */
+void unmap_frame (word_t frame, word_t kept_frame)
+{
+  word_t parent = frames[frame].parent;
+  write_entry (parent, frames[frame].slot, 0);
+  if (--frames[parent].refs == 0 && parent != 0 && parent != kept_frame)
   {
-    new_frame = max_available_frame (max_frames_found) + 1;
-    if (new_frame < NUM_FRAMES)
+    unmap_frame (parent, kept_frame);
+    free_frames[num_free_frames++] = parent;
+  }
+}
+
+/*
+ * writes the page in frame out, leaving the frame linked into its table
+ */
+void evict_frame (word_t frame)
+{
+  uint64_t evicted_page = frames[frame].page;
+  // waits for the threads accessing the page, and turns away later ones
+  lock_frame_exclusive (frame);
+  frames[frame].leaf = false;
+  unlock_frame_exclusive (frame);
+  if (frames[frame].prefetched.exchange (false))
+  {
+    prefetch_resolved (false);
+  }
+  policy->page_unmapped (frame);
+  tlb_invalidate (evicted_page);
+  evictions++;
+  if (frames[frame].dirty || !frames[frame].backed)
+  {
+    PMevict ((uint64_t) frame, evicted_page);
+    swapped[evicted_page] = true;
+    write_backs++;
+  }
+  else
+  {
+    write_backs_saved++;
+  }
+}
+
+/*
+ * restores page_number into frame, whose lock is held exclusively. A page
+ * that had a copy in the swap is only held by the frame from now on, while
+ * a page that never had one has no data to lose until it is written.
+ */
+void restore_page (word_t frame, uint64_t page_number)
+{
+  PMrestore ((uint64_t) frame, page_number);
+  frames[frame].dirty = false;
+  frames[frame].backed = !swapped[page_number];
+  swapped[page_number] = false;
+}
+
+/*
+ * splits the huge page holding the page in frame back into pages. The page
+ * is evicted, and its frame becomes the table of the others.
+ */
+void demote_huge_page (word_t frame)
+{
+  word_t first_frame = frame - (word_t) (frames[frame].page & (PAGE_SIZE - 1));
+  evict_frame (frame);
+  lock_frame_exclusive (frame);
+  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+  {
+    word_t page_frame = first_frame + (word_t) j;
+    frames[page_frame].huge = false;
+    if (page_frame == frame)
+    {
+      PMwrite ((uint64_t) (frame) * PAGE_SIZE + j, 0);
+      continue;
+    }
+    PMwrite ((uint64_t) (frame) * PAGE_SIZE + j, page_frame);
+    frames[page_frame].parent = frame;
+    frames[page_frame].slot = j;
+  }
+  unlock_frame_exclusive (frame);
+  frames[frame].refs = PAGE_SIZE - 1;
+  write_entry (frames[frame].parent, frames[frame].slot, frame);
+  huge_pages_split++;
+}
+
+/*
+ * maps the pages of a full table as one huge page and frees the table,
+ * when the pages lie in consecutive frames in the order of the entries.
+ */
+void promote_table (word_t table)
+{
+  if (table == 0 || frames[table].refs < PAGE_SIZE)
+  {
+    return;
+  }
+  word_t first_frame = 0;
+  PMread ((uint64_t) (table) * PAGE_SIZE, &first_frame);
+  for (uint64_t j = 1; j < PAGE_SIZE; ++j)
+  {
+    word_t page_frame = 0;
+    PMread ((uint64_t) (table) * PAGE_SIZE + j, &page_frame);
+    if (page_frame != first_frame + (word_t) j)
     {
       return;
     }
-    max_frames_found = true;
   }
-  min_index_distance evict_info = evict_page (page_number);
-  PMevict ((uint64_t) evict_info.evicted_frame, evict_info.evicted_page);
-  new_frame = evict_info.evicted_frame;
-  PMwrite ((uint64_t) (evict_info.frame_parent) * PAGE_SIZE
-           + evict_info.child_number, 0);
+  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+  {
+    frame_data &page_data = frames[first_frame + j];
+    page_data.parent = frames[table].parent;
+    page_data.slot = frames[table].slot;
+    page_data.huge = true;
+  }
+  write_entry (frames[table].parent, frames[table].slot,
+               first_frame | HUGE_ENTRY);
+  frames[table].refs = 0;
+  free_frames[num_free_frames++] = table;
+  huge_pages_made++;
 }
 
-uint64_t find_physical_address (uint64_t virtualAddress)
+/*
+ * finds a frame for a new table or page under cur_frame: a freed frame, a
+ * never used one, or else the frame of an evicted page.
+ */
+void find_frame (word_t cur_frame, word_t &new_frame, uint64_t page_number)
+{
+  if (num_free_frames > 0)
+  {
+    new_frame = free_frames[--num_free_frames];
+    return;
+  }
+  if (next_unused_frame < NUM_FRAMES)
+  {
+    new_frame = next_unused_frame++;
+    return;
+  }
+  new_frame = policy->choose_victim (page_number);
+  // a page of a huge page is evicted by splitting the huge page, and the
+  // frame then holds the table of the other pages
+  while (frames[new_frame].huge)
+  {
+    demote_huge_page (new_frame);
+    new_frame = policy->choose_victim (page_number);
+  }
+  evict_frame (new_frame);
+  // cur_frame may lose its last entry, but the new frame is linked into it
+  unmap_frame (new_frame, cur_frame);
+}
+
+/*
+ * walks the tables to the frame of page_number without changing them. Run
+ * without fault_mutex, the walk can pass through a table being changed, so
+ * the frame found must be checked to hold the page.
+ * returns whether a frame was found
+ */
+bool find_page (uint64_t page_number, word_t &frame)
+{
+  uint64_t mask = (1 << OFFSET_WIDTH) - 1;
+  frame = 0;
+  for (uint64_t i = TABLES_DEPTH; i > 0; --i)
+  {
+    uint64_t p = (page_number >> (OFFSET_WIDTH * (i - 1))) & mask;
+    // the words of a page are written under its shared lock, so a frame
+    // that became a page since the walk reached it is not read
+    word_t table = frame;
+    lock_frame_shared (table);
+    bool is_table = !frames[table].leaf;
+    if (is_table)
+    {
+      PMread ((uint64_t) (table) * PAGE_SIZE + p, &frame);
+    }
+    unlock_frame_shared (table);
+    if (!is_table)
+    {
+      return false;
+    }
+    if (i == 2 && (frame & HUGE_ENTRY))
+    {
+      frame = (frame & ~HUGE_ENTRY) + (word_t) (page_number & mask);
+      return (uint64_t) frame < NUM_FRAMES;
+    }
+    // a frame reused for a page while the walk read it holds data
+    if (frame == 0 || (uint64_t) frame >= NUM_FRAMES)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * walks from the root to the table holding the level entry of page_number,
+ * adding the tables missing on the way. Level 1 entries point to pages, and
+ * level 2 entries to the tables holding those.
+ * returns the frame of the table
+ */
+word_t map_tables (uint64_t page_number, uint64_t level)
 {
   uint64_t mask = (1 << OFFSET_WIDTH) - 1;
-  uint64_t offset = virtualAddress & mask;
   word_t parent_frame = 0;
   word_t child_frame = 0;
-  uint64_t page_number = virtualAddress >> OFFSET_WIDTH;
-  bool page_fault = false;
-  bool max_frames_found = false;
-
-  for (uint64_t i = TABLES_DEPTH; i > 0; --i)
+  for (uint64_t i = TABLES_DEPTH; i > level; --i)
   {
-    uint64_t p = (virtualAddress >> (OFFSET_WIDTH * i)) & mask;
+    uint64_t p = (page_number >> (OFFSET_WIDTH * (i - 1))) & mask;
     PMread ((uint64_t) (parent_frame) * PAGE_SIZE + p, &child_frame);
     if (child_frame == 0)
     {
-      page_fault = true;
-      find_frame (parent_frame, child_frame, page_number, max_frames_found);
-      if (i != 1)
+      find_frame (parent_frame, child_frame, page_number);
+      lock_frame_exclusive (child_frame);
+      for (uint64_t j = 0; j < PAGE_SIZE; ++j)
       {
-        for (uint64_t j = 0; j < PAGE_SIZE; ++j)
-        {
-          PMwrite ((uint64_t) (child_frame) * PAGE_SIZE + j, 0);
-        }
+        PMwrite ((uint64_t) (child_frame) * PAGE_SIZE + j, 0);
       }
-      PMwrite ((uint64_t) (parent_frame) * PAGE_SIZE + p, child_frame);
+      unlock_frame_exclusive (child_frame);
+      map_frame (parent_frame, p, child_frame);
     }
     parent_frame = child_frame;
   }
+  return parent_frame;
+}
+
+/*
+ * brings a page that is not in memory into a frame, adding the tables
+ * missing on its way. prefetched tells whether the page is read ahead.
+ * returns the page's frame
+ */
+word_t map_page (uint64_t page_number, bool prefetched)
+{
+  word_t table = map_tables (page_number, 1);
+  word_t frame = 0;
+  find_frame (table, frame, page_number);
+  map_frame (table, page_number & (PAGE_SIZE - 1), frame);
+
+  // the policy learns of the page before other threads can access it, and
+  // walks that still take the frame for a table wait for the restore
+  lock_frame_exclusive (frame);
+  restore_page (frame, page_number);
+  frames[frame].page = page_number;
+  frames[frame].prefetched = prefetched;
+  policy->page_mapped (frame);
+  frames[frame].leaf = true;
+  unlock_frame_exclusive (frame);
+  promote_table (table);
+  return frame;
+}
+
+void page_used (word_t frame)
+{
+  if (frames[frame].prefetched.load (std::memory_order_relaxed)
+      && frames[frame].prefetched.exchange (false))
+  {
+    read_ahead_hits++;
+    prefetch_resolved (true);
+  }
+  policy->page_accessed (frame);
+}
+
+/*
+ * marks the page in frame dirty, so it is written out when evicted. Called
+ * with the frame locked shared.
+ */
+void page_written (word_t frame)
+{
+  if (!frames[frame].dirty.load (std::memory_order_relaxed))
+  {
+    frames[frame].dirty.store (true, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * finds the stream a fault of page_number continues, or starts a new one in
+ * place of the least recently used stream, and grows its window.
+ */
+stream_data *match_stream (uint64_t page_number)
+{
+  stream_data *oldest = &streams[0];
+  for (uint64_t i = 0; i < READAHEAD_STREAMS; ++i)
+  {
+    stream_data *stream = &streams[i];
+    if (stream->stride != 0 && stream->next_page == page_number)
+    {
+      if (readahead_limit == 0)
+      {
+        // nothing is read ahead, but a right guess shows it would help
+        prefetch_resolved (true);
+      }
+      stream->window = std::min<uint64_t> (readahead_limit, std::max<uint64_t> (
+          1, 2 * stream->window));
+      stream->last_page = page_number;
+      stream->next_page = page_number
+                          + (stream->window + 1) * stream->stride;
+      stream->last_use = ++stream_clock;
+      return stream;
+    }
+    if (stream->last_use < oldest->last_use)
+    {
+      oldest = stream;
+    }
+  }
+
+  for (uint64_t i = 0; i < READAHEAD_STREAMS; ++i)
+  {
+    stream_data *stream = &streams[i];
+    int64_t stride = (int64_t) page_number - (int64_t) stream->last_page;
+    if (stride != 0 && stride >= -READAHEAD_MAX_STRIDE
+        && stride <= READAHEAD_MAX_STRIDE)
+    {
+      // the stream is only read ahead once a third fault confirms the stride
+      *stream = {page_number, stride, page_number + stride, 0,
+                 ++stream_clock};
+      return stream;
+    }
+  }
+
+  *oldest = {page_number, 0, 0, 0, ++stream_clock};
+  return oldest;
+}
+
+/*
+ * on a fault of page_number, brings in the pages its stream is expected to
+ * fault on next. They are marked prefetched until accessed, to tell whether
+ * reading ahead pays off.
+ */
+void read_ahead (uint64_t page_number)
+{
+  stream_data *stream = match_stream (page_number);
+  for (uint64_t i = 1; i <= stream->window; ++i)
+  {
+    int64_t page = (int64_t) page_number + (int64_t) i * stream->stride;
+    if (page < 0 || page >= (int64_t) NUM_PAGES)
+    {
+      break;
+    }
+    word_t frame = 0;
+    if (!find_page ((uint64_t) page, frame))
+    {
+      map_page ((uint64_t) page, true);
+      pages_read_ahead++;
+    }
+  }
+}
 
-  if (page_fault)
+/*
+ * translates virtualAddress, bringing its page in on a fault. The frame of
+ * the page is returned locked shared, and the caller unlocks it once done
+ * accessing the page.
+ */
+uint64_t find_physical_address (uint64_t virtualAddress)
+{
+  uint64_t offset = virtualAddress & ((1 << OFFSET_WIDTH) - 1);
+  uint64_t page_number = virtualAddress >> OFFSET_WIDTH;
+  word_t frame = 0;
+
+  if (tlb_lookup (page_number, frame) && lock_page (frame, page_number))
+  {
+    page_used (frame);
+    return (uint64_t) (frame) * PAGE_SIZE + offset;
+  }
+  if (find_page (page_number, frame) && lock_page (frame, page_number))
+  {
+    page_used (frame);
+    tlb_insert (page_number, frame);
+    return (uint64_t) (frame) * PAGE_SIZE + offset;
+  }
+
+  std::lock_guard<std::mutex> guard (fault_mutex);
+  // another thread may have brought the page in meanwhile
+  if (find_page (page_number, frame) && lock_page (frame, page_number))
   {
-    PMrestore ((uint64_t) parent_frame, page_number);
+    page_used (frame);
   }
-  return (uint64_t) (parent_frame) * PAGE_SIZE + offset;
+  else
+  {
+    // the faulting page is mapped first, so a scan leaves its pages in
+    // consecutive frames for promote_table
+    frame = map_page (page_number, false);
+    page_faults++;
+    read_ahead (page_number);
+    if (!frames[frame].leaf || frames[frame].page != page_number)
+    {
+      // reading ahead evicted it again
+      frame = map_page (page_number, false);
+    }
+    lock_frame_shared (frame);
+  }
+  tlb_insert (page_number, frame);
+  return (uint64_t) (frame) * PAGE_SIZE + offset;
 }
 
 int VMread (uint64_t virtualAddress, word_t *value)
@@ -207,6 +1150,7 @@ int VMread (uint64_t virtualAddress, word_t *value)
   }
   uint64_t physical_address = find_physical_address (virtualAddress);
   PMread (physical_address, value);
+  unlock_frame_shared (physical_address / PAGE_SIZE);
   return 1;
 }
 
@@ -218,5 +1162,231 @@ int VMwrite (uint64_t virtualAddress, word_t value)
   }
   uint64_t physical_address = find_physical_address (virtualAddress);
   PMwrite (physical_address, value);
+  page_written (physical_address / PAGE_SIZE);
+  unlock_frame_shared (physical_address / PAGE_SIZE);
+  return 1;
+}
+
+uint64_t VMreadRange (uint64_t virtualAddress, word_t *values, uint64_t count)
+{
+  uint64_t done = 0;
+  while (done < count && virtualAddress + done < VIRTUAL_MEMORY_SIZE)
+  {
+    uint64_t address = virtualAddress + done;
+    uint64_t physical_address = find_physical_address (address);
+    // the rest of the page lies in the same frame
+    uint64_t in_page = std::min<uint64_t> (PAGE_SIZE - address % PAGE_SIZE,
+                                           count - done);
+    for (uint64_t i = 0; i < in_page; ++i)
+    {
+      PMread (physical_address + i, values + done + i);
+    }
+    unlock_frame_shared (physical_address / PAGE_SIZE);
+    done += in_page;
+  }
+  return done;
+}
+
+uint64_t VMwriteRange (uint64_t virtualAddress, const word_t *values,
+                       uint64_t count)
+{
+  uint64_t done = 0;
+  while (done < count && virtualAddress + done < VIRTUAL_MEMORY_SIZE)
+  {
+    uint64_t address = virtualAddress + done;
+    uint64_t physical_address = find_physical_address (address);
+    uint64_t in_page = std::min<uint64_t> (PAGE_SIZE - address % PAGE_SIZE,
+                                           count - done);
+    for (uint64_t i = 0; i < in_page; ++i)
+    {
+      PMwrite (physical_address + i, values[done + i]);
+    }
+    page_written (physical_address / PAGE_SIZE);
+    unlock_frame_shared (physical_address / PAGE_SIZE);
+    done += in_page;
+  }
+  return done;
+}
+
+uint64_t VMcopy (uint64_t dstAddress, uint64_t srcAddress, uint64_t count)
+{
+  uint64_t highest = std::max (dstAddress, srcAddress);
+  if (highest >= VIRTUAL_MEMORY_SIZE)
+  {
+    return 0;
+  }
+  count = std::min<uint64_t> (count, VIRTUAL_MEMORY_SIZE - highest);
+
+  // a destination overlapping the end of the source is copied back to
+  // front, so no word is overwritten before it is read
+  bool backward = dstAddress > srcAddress && dstAddress < srcAddress + count;
+  word_t buffer[PAGE_SIZE];
+  uint64_t done = 0;
+  while (done < count)
+  {
+    uint64_t chunk = std::min<uint64_t> (PAGE_SIZE, count - done);
+    uint64_t offset = backward ? count - done - chunk : done;
+    VMreadRange (srcAddress + offset, buffer, chunk);
+    VMwriteRange (dstAddress + offset, buffer, chunk);
+    done += chunk;
+  }
+  return count;
+}
+
+/*
+ * finds PAGE_SIZE consecutive frames without tables, the ones holding the
+ * fewest pages.
+ * returns whether there are such frames
+ */
+bool find_frame_run (word_t &first_frame)
+{
+  std::vector<bool> is_free (NUM_FRAMES, false);
+  for (uint64_t i = 0; i < num_free_frames; ++i)
+  {
+    is_free[free_frames[i]] = true;
+  }
+  uint64_t fewest_pages = PAGE_SIZE + 1;
+  for (uint64_t first = 1; first + PAGE_SIZE <= NUM_FRAMES; ++first)
+  {
+    uint64_t pages = 0;
+    for (uint64_t f = first; f < first + PAGE_SIZE && pages < fewest_pages;
+         ++f)
+    {
+      if (f >= (uint64_t) next_unused_frame || is_free[f])
+      {
+        continue;
+      }
+      // tables cannot be moved, so the frames of a table end the run, as do
+      // huge pages reaching out of it
+      bool evictable = frames[f].leaf
+                       && (!frames[f].huge
+                           || f - (frames[f].page & (PAGE_SIZE - 1)) == first);
+      pages = evictable ? pages + 1 : fewest_pages;
+    }
+    if (pages < fewest_pages)
+    {
+      fewest_pages = pages;
+      first_frame = (word_t) first;
+    }
+  }
+  return fewest_pages <= PAGE_SIZE;
+}
+
+/*
+ * writes out the pages of the huge page starting at first_frame, and
+ * unlinks it.
+ */
+void evict_huge_page (word_t first_frame)
+{
+  for (word_t f = first_frame; f < first_frame + PAGE_SIZE; ++f)
+  {
+    evict_frame (f);
+    frames[f].huge = false;
+  }
+  unmap_frame (first_frame, 0);
+}
+
+/*
+ * empties the frames of a run found by find_frame_run, and takes them out
+ * of the free and never used frames.
+ */
+void take_frame_run (word_t first_frame)
+{
+  word_t end_frame = first_frame + PAGE_SIZE;
+  for (word_t f = first_frame; f < end_frame && f < next_unused_frame; ++f)
+  {
+    if (frames[f].huge)
+    {
+      evict_huge_page (f - (word_t) (frames[f].page & (PAGE_SIZE - 1)));
+    }
+    else if (frames[f].leaf)
+    {
+      evict_frame (f);
+      unmap_frame (f, 0);
+    }
+  }
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < num_free_frames; ++i)
+  {
+    if (free_frames[i] < first_frame || free_frames[i] >= end_frame)
+    {
+      free_frames[kept++] = free_frames[i];
+    }
+  }
+  num_free_frames = kept;
+  // never used frames before the run are freed, the ones in it taken
+  for (; next_unused_frame < end_frame; ++next_unused_frame)
+  {
+    if (next_unused_frame < first_frame)
+    {
+      free_frames[num_free_frames++] = next_unused_frame;
+    }
+  }
+}
+
+int VMallocHuge (uint64_t virtualAddress)
+{
+  // the tables on the way need frames besides the huge page's
+  if (TABLES_DEPTH < 2 || NUM_FRAMES < PAGE_SIZE + TABLES_DEPTH
+      || virtualAddress >= VIRTUAL_MEMORY_SIZE
+      || virtualAddress % HUGE_PAGE_SIZE != 0)
+  {
+    return 0;
+  }
+  std::lock_guard<std::mutex> guard (fault_mutex);
+  uint64_t first_page = virtualAddress >> OFFSET_WIDTH;
+  word_t frame = 0;
+  if (find_page (first_page, frame) && frames[frame].huge)
+  {
+    return 1;
+  }
+  word_t first_frame = 0;
+  if (!find_frame_run (first_frame))
+  {
+    return 0;
+  }
+  take_frame_run (first_frame);
+  // the pages already in memory are written out and restored into the run
+  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+  {
+    if (find_page (first_page + j, frame))
+    {
+      evict_frame (frame);
+      unmap_frame (frame, 0);
+    }
+  }
+
+  word_t table = map_tables (first_page, 2);
+  uint64_t slot = (first_page >> OFFSET_WIDTH) & (PAGE_SIZE - 1);
+  for (uint64_t j = 0; j < PAGE_SIZE; ++j)
+  {
+    frame = first_frame + (word_t) j;
+    frames[frame].parent = table;
+    frames[frame].slot = slot;
+    frames[frame].refs = 0;
+    lock_frame_exclusive (frame);
+    restore_page (frame, first_page + j);
+    frames[frame].page = first_page + j;
+    frames[frame].prefetched = false;
+    frames[frame].huge = true;
+    policy->page_mapped (frame);
+    frames[frame].leaf = true;
+    unlock_frame_exclusive (frame);
+  }
+  write_entry (table, slot, first_frame | HUGE_ENTRY);
+  frames[table].refs++;
+  huge_pages_made++;
   return 1;
-}
\ No newline at end of file
+}
+
+void VMgetStats (vm_stats_t *stats)
+{
+  stats->page_faults = page_faults;
+  stats->pages_read_ahead = pages_read_ahead;
+  stats->read_ahead_hits = read_ahead_hits;
+  stats->evictions = evictions;
+  stats->write_backs = write_backs;
+  stats->write_backs_saved = write_backs_saved;
+  stats->huge_pages_made = huge_pages_made;
+  stats->huge_pages_split = huge_pages_split;
+}
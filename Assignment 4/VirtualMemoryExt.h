@@ -0,0 +1,100 @@
+#pragma once
+
+#include "VirtualMemory.h"
+
+/*
+ * VMread, VMwrite and the range calls may be made from several threads at
+ * once. VMinitialize and VMsetReplacementPolicy may not run alongside any
+ * other call.
+ */
+
+/*
+ * the ways the VM can choose the page to evict when no frame is free.
+ * CYCLIC_DISTANCE_POLICY evicts the page cyclically farthest from the page
+ * being brought in, walking all the tables. The others choose in O(1)
+ * amortized time from what they track about the accessed pages:
+ * CLOCK_POLICY gives every page a second chance, LRU_POLICY evicts the
+ * least recently used of a few sampled pages, and ARC_POLICY balances
+ * recently and frequently used pages, adapting to the access pattern.
+ */
+enum replacement_policy_t
+{
+    CYCLIC_DISTANCE_POLICY = 0,
+    CLOCK_POLICY = 1,
+    LRU_POLICY = 2,
+    ARC_POLICY = 3
+};
+
+/*
+ * Selects the replacement policy, used from the next VMinitialize on.
+ * The default is CYCLIC_DISTANCE_POLICY.
+ */
+void VMsetReplacementPolicy (replacement_policy_t policy);
+
+/*
+ * Reads count words starting at virtualAddress into values, translating
+ * each page once.
+ * returns the number of words read, less than count when the range passes
+ * the end of the virtual memory.
+ */
+uint64_t VMreadRange (uint64_t virtualAddress, word_t *values, uint64_t count);
+
+/*
+ * Writes count words from values starting at virtualAddress, translating
+ * each page once.
+ * returns the number of words written, less than count when the range
+ * passes the end of the virtual memory.
+ */
+uint64_t VMwriteRange (uint64_t virtualAddress, const word_t *values,
+                       uint64_t count);
+
+/*
+ * Copies count words from srcAddress to dstAddress, a page at a time.
+ * The ranges may overlap.
+ * returns the number of words copied, less than count when either range
+ * passes the end of the virtual memory.
+ */
+uint64_t VMcopy (uint64_t dstAddress, uint64_t srcAddress, uint64_t count);
+
+/*
+ * the words mapped by a huge page: the PAGE_SIZE pages of one table, held
+ * in consecutive frames and translated by a single table entry
+ */
+#define HUGE_PAGE_SIZE (PAGE_SIZE * PAGE_SIZE)
+
+/*
+ * Maps the HUGE_PAGE_SIZE words at virtualAddress, which must be a multiple
+ * of HUGE_PAGE_SIZE, as a huge page, bringing its pages into memory.
+ * Tables whose pages come to lie in consecutive frames are made huge pages
+ * on their own, and a huge page is split back into pages when one of them
+ * is evicted.
+ * returns 1 on success, 0 if the address is invalid or no frames without
+ * tables can be found for it.
+ */
+int VMallocHuge (uint64_t virtualAddress);
+
+/*
+ * counts of the work done since VMinitialize
+ */
+typedef struct
+{
+    // faults on pages accessed, not counting the pages read ahead
+    uint64_t page_faults;
+    uint64_t pages_read_ahead;
+    // pages read ahead that were accessed before being evicted
+    uint64_t read_ahead_hits;
+    uint64_t evictions;
+    // evictions that wrote the page out with PMevict
+    uint64_t write_backs;
+    // evictions of clean pages with nothing to lose, dropped without PMevict
+    uint64_t write_backs_saved;
+    // huge pages made by VMallocHuge or from full tables, and split again
+    uint64_t huge_pages_made;
+    uint64_t huge_pages_split;
+} vm_stats_t;
+
+/*
+ * Fills stats with the counts so far. May be called while other threads
+ * access the memory, each count then being read on its own.
+ */
+void VMgetStats (vm_stats_t *stats);
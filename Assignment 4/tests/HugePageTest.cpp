@@ -0,0 +1,139 @@
+#include "VirtualMemory.h"
+#include "VirtualMemoryExt.h"
+#include <cstdio>
+
+#define NUM_POLICIES 4
+// pages touched to push the huge page out, several times the frames
+#define EVICTING_PAGES (4 * NUM_FRAMES)
+
+/*
+ * Single threaded test of huge pages under every replacement policy. It
+ * maps a huge page with VMallocHuge right after VMinitialize and checks
+ * every word of it, touches enough other pages to split it and checks it
+ * again, then fills an aligned region in order on a fresh VM and checks
+ * that its table was made a huge page.
+ * usage: HugePageTest
+ */
+
+/*
+ * the value written to virtualAddress in the given pass
+ */
+word_t word_value (uint64_t virtualAddress, int pass)
+{
+  return (word_t) (virtualAddress * 2654435761u + pass);
+}
+
+/*
+ * writes the HUGE_PAGE_SIZE words at first in order.
+ */
+void fill_region (uint64_t first, int pass)
+{
+  for (uint64_t a = first; a < first + HUGE_PAGE_SIZE; ++a)
+  {
+    VMwrite (a, word_value (a, pass));
+  }
+}
+
+/*
+ * reads the HUGE_PAGE_SIZE words at first back.
+ * returns the number of words not holding what fill_region wrote
+ */
+uint64_t check_region (uint64_t first, int pass)
+{
+  uint64_t mismatches = 0;
+  for (uint64_t a = first; a < first + HUGE_PAGE_SIZE; ++a)
+  {
+    word_t value = 0;
+    if (!VMread (a, &value) || value != word_value (a, pass))
+    {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+/*
+ * runs the test under one policy.
+ * returns whether it passed
+ */
+bool test_policy (replacement_policy_t policy)
+{
+  // the huge page, the pages pushing it out and the promoted region lie in
+  // different tables
+  uint64_t huge_first = HUGE_PAGE_SIZE;
+  uint64_t evicting_first = 4 * HUGE_PAGE_SIZE;
+  uint64_t promoted_first = 2 * HUGE_PAGE_SIZE;
+  if (evicting_first + EVICTING_PAGES * PAGE_SIZE > VIRTUAL_MEMORY_SIZE)
+  {
+    printf ("policy %d: the virtual memory is too small\n", policy);
+    return false;
+  }
+  VMsetReplacementPolicy (policy);
+  VMinitialize ();
+  vm_stats_t stats;
+
+  if (!VMallocHuge (huge_first))
+  {
+    printf ("policy %d: VMallocHuge failed after VMinitialize\n", policy);
+    return false;
+  }
+  fill_region (huge_first, 1);
+  uint64_t mismatches = check_region (huge_first, 1);
+  VMgetStats (&stats);
+  if (mismatches > 0 || stats.huge_pages_made != 1
+      || stats.huge_pages_split != 0)
+  {
+    printf ("policy %d: huge page: %llu mismatches, %llu made, %llu split\n",
+            policy, (unsigned long long) mismatches,
+            (unsigned long long) stats.huge_pages_made,
+            (unsigned long long) stats.huge_pages_split);
+    return false;
+  }
+
+  for (uint64_t i = 0; i < EVICTING_PAGES; ++i)
+  {
+    VMwrite (evicting_first + i * PAGE_SIZE, (word_t) i);
+  }
+  VMgetStats (&stats);
+  uint64_t split = stats.huge_pages_split;
+  mismatches = check_region (huge_first, 1);
+  if (mismatches > 0 || split == 0)
+  {
+    printf ("policy %d: after evictions: %llu mismatches, %llu split\n",
+            policy, (unsigned long long) mismatches,
+            (unsigned long long) split);
+    return false;
+  }
+
+  VMinitialize ();
+  fill_region (promoted_first, 2);
+  VMgetStats (&stats);
+  uint64_t made = stats.huge_pages_made;
+  mismatches = check_region (promoted_first, 2);
+  if (mismatches > 0 || made != 1)
+  {
+    printf ("policy %d: filled region: %llu mismatches, %llu made\n",
+            policy, (unsigned long long) mismatches,
+            (unsigned long long) made);
+    return false;
+  }
+  printf ("policy %d: ok, %llu huge pages split\n", policy,
+          (unsigned long long) split);
+  return true;
+}
+
+int main ()
+{
+  if (TABLES_DEPTH < 2 || NUM_FRAMES < PAGE_SIZE + TABLES_DEPTH)
+  {
+    printf ("huge pages need at least two levels of tables and %llu "
+            "frames\n", (unsigned long long) (PAGE_SIZE + TABLES_DEPTH));
+    return 1;
+  }
+  bool passed = true;
+  for (int policy = 0; policy < NUM_POLICIES; ++policy)
+  {
+    passed = test_policy ((replacement_policy_t) policy) && passed;
+  }
+  return passed ? 0 : 1;
+}
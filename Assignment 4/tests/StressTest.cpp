@@ -0,0 +1,274 @@
+#include "VirtualMemory.h"
+#include "VirtualMemoryExt.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define STRESS_THREADS 8
+#define STRESS_DEFAULT_OPS 20000
+#define STRESS_RANGE_WORDS (2 * PAGE_SIZE + 3)
+#define STRESS_HUGE_CHANCE 1000
+#define STRESS_SEED 20240601
+#define NUM_POLICIES 4
+
+/*
+ * Stress test of the VM from several threads at once. Every thread owns a
+ * region of the virtual memory and mixes single words, ranges and copies
+ * inside it with requests for huge pages there, checking every word it
+ * reads against a shadow of what it wrote. The threads live through one
+ * round per replacement policy, with VMinitialize run between the rounds.
+ * usage: StressTest [ops_per_thread]
+ */
+
+/*
+ * a thread's region [first, first + size) and what it wrote there
+ */
+typedef struct
+{
+    uint64_t first;
+    uint64_t size;
+    std::vector<word_t> shadow;
+    // words written since the round began, the others hold no known value
+    std::vector<bool> written;
+    std::mt19937_64 random;
+    uint64_t mismatches;
+    uint64_t huge_pages;
+} thread_data;
+
+// the round the threads run, every round ending once all of them are done
+static std::mutex round_mutex;
+static std::condition_variable round_changed;
+static int current_round = -1;
+static int threads_done = 0;
+static bool stopping = false;
+
+/*
+ * checks count words read at offset of the thread's region against its
+ * shadow.
+ */
+void check_words (thread_data *data, uint64_t offset, const word_t *values,
+                  uint64_t count)
+{
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    if (data->written[offset + i] && values[i] != data->shadow[offset + i])
+    {
+      data->mismatches++;
+    }
+  }
+}
+
+/*
+ * asks for a huge page at a random multiple of HUGE_PAGE_SIZE inside the
+ * thread's region, if the region holds any.
+ */
+void alloc_huge_page (thread_data *data)
+{
+  uint64_t first = (data->first + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+  uint64_t end = (data->first + data->size) / HUGE_PAGE_SIZE;
+  if (end <= first)
+  {
+    return;
+  }
+  uint64_t huge_page = first + data->random () % (end - first);
+  data->huge_pages += VMallocHuge (huge_page * HUGE_PAGE_SIZE);
+}
+
+/*
+ * runs ops random accesses to the thread's region, then reads all of the
+ * words it wrote back.
+ */
+void run_round (thread_data *data, uint64_t ops)
+{
+  data->shadow.assign (data->size, 0);
+  data->written.assign (data->size, false);
+  word_t values[STRESS_RANGE_WORDS];
+  uint64_t next_offset = 0;
+  for (uint64_t i = 0; i < ops; ++i)
+  {
+    // half of the accesses go on from where the previous one ended, so
+    // the faults come in runs the VM reads ahead
+    uint64_t offset = data->random () % 2 ? next_offset
+                                           : data->random () % data->size;
+    uint64_t count = 1 + data->random () % STRESS_RANGE_WORDS;
+    count = std::min (count, data->size - offset);
+    next_offset = (offset + count) % data->size;
+    uint64_t address = data->first + offset;
+    switch (data->random () % 5)
+    {
+      case 0:
+        values[0] = (word_t) data->random ();
+        if (!VMwrite (address, values[0]))
+        {
+          data->mismatches++;
+        }
+        data->shadow[offset] = values[0];
+        data->written[offset] = true;
+        break;
+      case 1:
+        if (!VMread (address, values))
+        {
+          data->mismatches++;
+        }
+        check_words (data, offset, values, 1);
+        break;
+      case 2:
+        for (uint64_t j = 0; j < count; ++j)
+        {
+          values[j] = (word_t) data->random ();
+          data->shadow[offset + j] = values[j];
+          data->written[offset + j] = true;
+        }
+        if (VMwriteRange (address, values, count) != count)
+        {
+          data->mismatches++;
+        }
+        break;
+      case 3:
+        if (VMreadRange (address, values, count) != count)
+        {
+          data->mismatches++;
+        }
+        check_words (data, offset, values, count);
+        break;
+      default:
+      {
+        // the ranges may overlap, the shadow is copied through a buffer
+        uint64_t src_offset = data->random () % (data->size - count + 1);
+        if (VMcopy (address, data->first + src_offset, count) != count)
+        {
+          data->mismatches++;
+        }
+        std::vector<word_t> shadow (data->shadow.begin () + src_offset,
+                                    data->shadow.begin () + src_offset
+                                    + count);
+        std::vector<bool> written (data->written.begin () + src_offset,
+                                   data->written.begin () + src_offset
+                                   + count);
+        std::copy (shadow.begin (), shadow.end (),
+                   data->shadow.begin () + offset);
+        std::copy (written.begin (), written.end (),
+                   data->written.begin () + offset);
+        break;
+      }
+    }
+    if (data->random () % STRESS_HUGE_CHANCE == 0)
+    {
+      alloc_huge_page (data);
+    }
+  }
+
+  for (uint64_t offset = 0; offset < data->size; ++offset)
+  {
+    if (data->written[offset])
+    {
+      VMread (data->first + offset, values);
+      check_words (data, offset, values, 1);
+    }
+  }
+}
+
+/*
+ * runs a round of the thread every time the round changes, until stopping
+ * is set.
+ */
+void run_thread (thread_data *data, uint64_t ops)
+{
+  int last_round = -1;
+  while (true)
+  {
+    {
+      std::unique_lock<std::mutex> lock (round_mutex);
+      while (!stopping && current_round == last_round)
+      {
+        round_changed.wait (lock);
+      }
+      if (stopping)
+      {
+        return;
+      }
+      last_round = current_round;
+    }
+    run_round (data, ops);
+    {
+      std::lock_guard<std::mutex> lock (round_mutex);
+      threads_done++;
+    }
+    round_changed.notify_all ();
+  }
+}
+
+int main (int argc, char **argv)
+{
+  uint64_t ops = argc > 1 ? strtoull (argv[1], nullptr, 10)
+                          : STRESS_DEFAULT_OPS;
+  std::vector<thread_data> threads (STRESS_THREADS);
+  std::vector<std::thread> workers;
+  uint64_t region_size = VIRTUAL_MEMORY_SIZE / STRESS_THREADS;
+  for (int t = 0; t < STRESS_THREADS; ++t)
+  {
+    threads[t].first = t * region_size;
+    threads[t].size = region_size;
+    threads[t].random.seed (STRESS_SEED + t);
+  }
+  for (int t = 0; t < STRESS_THREADS; ++t)
+  {
+    workers.emplace_back (run_thread, &threads[t], ops);
+  }
+
+  uint64_t total_mismatches = 0;
+  for (int policy = 0; policy < NUM_POLICIES; ++policy)
+  {
+    VMsetReplacementPolicy ((replacement_policy_t) policy);
+    VMinitialize ();
+    for (thread_data &data: threads)
+    {
+      data.mismatches = 0;
+      data.huge_pages = 0;
+    }
+    {
+      std::unique_lock<std::mutex> lock (round_mutex);
+      threads_done = 0;
+      current_round = policy;
+      round_changed.notify_all ();
+      while (threads_done < STRESS_THREADS)
+      {
+        round_changed.wait (lock);
+      }
+    }
+
+    uint64_t mismatches = 0;
+    uint64_t huge_pages = 0;
+    for (const thread_data &data: threads)
+    {
+      mismatches += data.mismatches;
+      huge_pages += data.huge_pages;
+    }
+    vm_stats_t stats;
+    VMgetStats (&stats);
+    printf ("policy %d: %llu mismatches, %llu faults, %llu evictions, "
+            "%llu write-backs, %llu huge pages allocated\n", policy,
+            (unsigned long long) mismatches,
+            (unsigned long long) stats.page_faults,
+            (unsigned long long) stats.evictions,
+            (unsigned long long) stats.write_backs,
+            (unsigned long long) huge_pages);
+    total_mismatches += mismatches;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock (round_mutex);
+    stopping = true;
+  }
+  round_changed.notify_all ();
+  for (std::thread &worker: workers)
+  {
+    worker.join ();
+  }
+  return total_mismatches == 0 ? 0 : 1;
+}